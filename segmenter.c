@@ -20,6 +20,9 @@
 #endif /* CONFIG_H */
 
 #include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -27,8 +30,35 @@
 #ifdef HAVE_LIBGEN_H
 #include <libgen.h>
 #endif /* HAVE_LIBGEN_H */
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif /* HAVE_UNISTD_H */
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif /* HAVE_FCNTL_H */
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif /* HAVE_SYS_STAT_H */
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif /* HAVE_SYS_TIME_H */
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_PTHREAD)
+#include <pthread.h>
+#define USE_THREADS 1
+#endif
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#define USE_MMAP_READER 1
+#endif
 
 #include "libavformat/avformat.h"
+#include "libavutil/sha.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif /* __SSE2__ */
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 #ifdef HAVE_AV_MEDIA_TYPE
 #define CODEC_TYPE_AUDIO AVMEDIA_TYPE_AUDIO
@@ -39,6 +69,24 @@
 #define PKT_FLAG_KEY AV_PKT_FLAG_KEY
 #endif /* HAVE_AV_PKT_FLAG_KEY */
 
+/*
+ * Static tracepoints of the "segmenter" provider, compiled in with
+ * --enable-usdt.  Each probe site is a single nop until a tracer attaches
+ * to it; without --enable-usdt the probes compile to nothing.
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define SEGMENTER_PROBE0(name) DTRACE_PROBE(segmenter, name)
+#define SEGMENTER_PROBE1(name, a) DTRACE_PROBE1(segmenter, name, a)
+#define SEGMENTER_PROBE2(name, a, b) DTRACE_PROBE2(segmenter, name, a, b)
+#define SEGMENTER_PROBE3(name, a, b, c) DTRACE_PROBE3(segmenter, name, a, b, c)
+#else
+#define SEGMENTER_PROBE0(name) ((void)0)
+#define SEGMENTER_PROBE1(name, a) ((void)0)
+#define SEGMENTER_PROBE2(name, a, b) ((void)0)
+#define SEGMENTER_PROBE3(name, a, b, c) ((void)0)
+#endif /* ENABLE_USDT */
+
 static void *xmalloc(size_t sz)
 {
     void *retval = malloc(sz);
@@ -117,6 +165,44 @@ static void char_ptr_array_free(CharPtrArray *arr)
     arr->elems = NULL;
 }
 
+typedef struct CharBuffer {
+    char *buf;
+    size_t len;
+    size_t alloc;
+} CharBuffer;
+
+static int char_buffer_printf(CharBuffer *b, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->buf ? b->buf + b->len: NULL, b->alloc - b->len, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return n;
+        if (b->len + n < b->alloc)
+            break;
+        {
+            size_t alloc = b->alloc ? b->alloc: 256;
+            while (alloc <= b->len + n)
+                alloc += alloc >> 1;
+            b->buf = xrealloc(b->buf, alloc);
+            b->alloc = alloc;
+        }
+    }
+    b->len += n;
+    return n;
+}
+
+static void char_buffer_free(CharBuffer *b)
+{
+    if (b->buf)
+        free(b->buf);
+    b->buf = NULL;
+}
+
 #ifndef HAVE_BASENAME
 static char *basename(char *path)
 {
@@ -215,6 +301,515 @@ static AVInputFormat *guess_input_format_from_filename(const char *filename)
     return NULL;
 }
 
+static double get_wallclock(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+#ifdef USE_MMAP_READER
+#define MMAP_READER_WINDOW_SIZE (64 << 20)
+#define MMAP_READER_READAHEAD_SIZE (2 << 20)
+#define MMAP_READER_BUFFER_SIZE (32 << 10) /* the same as the file protocol's AVIO buffer */
+#define MMAP_READER_POLL_INTERVAL 100000 /* usec */
+
+/*
+ * Input reader that maps the file in fixed-size windows instead of going
+ * through read(2).  The AVIOContext buffer is refilled with a single copy
+ * straight out of the page cache, and the kernel is told the access pattern
+ * is sequential.  When follow_timeout is positive, reaching the end of the
+ * file waits for it to grow (live-to-VOD recordings) and only reports EOF
+ * once it has not grown for that many seconds.
+ */
+typedef struct MmapReader {
+    int fd;
+    unsigned char *map;
+    off_t map_offset;
+    size_t map_size;
+    off_t file_size;
+    off_t pos;
+    off_t advised_pos;
+    size_t page_size;
+    double follow_timeout;
+    AVIOContext *pb;
+} MmapReader;
+
+static int mmap_reader_update_file_size(MmapReader *reader)
+{
+    struct stat st;
+    if (fstat(reader->fd, &st) < 0)
+        return 1;
+    reader->file_size = st.st_size;
+    return 0;
+}
+
+static void mmap_reader_unmap(MmapReader *reader)
+{
+    if (reader->map) {
+        munmap(reader->map, reader->map_size);
+        reader->map = NULL;
+        reader->map_size = 0;
+    }
+}
+
+static int mmap_reader_map_window(MmapReader *reader)
+{
+    off_t offset = reader->pos & ~(off_t)(reader->page_size - 1);
+    size_t size = MMAP_READER_WINDOW_SIZE;
+    void *map;
+
+    mmap_reader_unmap(reader);
+
+    if (reader->file_size - offset < (off_t)size)
+        size = reader->file_size - offset;
+    if (size == 0)
+        return 1;
+
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, reader->fd, offset);
+    if (map == MAP_FAILED) {
+        av_log(NULL, AV_LOG_ERROR, "Could not map input file: %s\n", strerror(errno));
+        return 1;
+    }
+#ifdef HAVE_MADVISE
+    madvise(map, size, MADV_SEQUENTIAL);
+#endif /* HAVE_MADVISE */
+    reader->map = map;
+    reader->map_offset = offset;
+    reader->map_size = size;
+    reader->advised_pos = reader->pos;
+    return 0;
+}
+
+static int mmap_reader_wait_for_data(MmapReader *reader)
+{
+    double deadline = get_wallclock() + reader->follow_timeout;
+
+    for (;;) {
+        if (mmap_reader_update_file_size(reader))
+            return 1;
+        if (reader->pos < reader->file_size)
+            return 0;
+        if (reader->follow_timeout <= 0. || get_wallclock() >= deadline)
+            return 1;
+        usleep(MMAP_READER_POLL_INTERVAL);
+    }
+}
+
+static int mmap_reader_read_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    MmapReader *reader = opaque;
+    size_t avail;
+
+    if (reader->pos >= reader->file_size && mmap_reader_wait_for_data(reader))
+        return AVERROR_EOF;
+
+    if (!reader->map || reader->pos < reader->map_offset || reader->pos >= reader->map_offset + (off_t)reader->map_size) {
+        if (mmap_reader_map_window(reader))
+            return AVERROR(EIO);
+    }
+
+#ifdef HAVE_MADVISE
+    if (reader->pos >= reader->advised_pos) {
+        size_t off = (reader->pos - reader->map_offset) & ~(reader->page_size - 1);
+        size_t len = reader->map_size - off;
+        if (len > MMAP_READER_READAHEAD_SIZE)
+            len = MMAP_READER_READAHEAD_SIZE;
+        madvise(reader->map + off, len, MADV_WILLNEED);
+        reader->advised_pos = reader->map_offset + off + len / 2;
+    }
+#endif /* HAVE_MADVISE */
+
+    avail = reader->map_offset + reader->map_size - reader->pos;
+    if (avail > (size_t)buf_size)
+        avail = buf_size;
+    memcpy(buf, reader->map + (reader->pos - reader->map_offset), avail);
+    reader->pos += avail;
+    return avail;
+}
+
+static int64_t mmap_reader_seek(void *opaque, int64_t offset, int whence)
+{
+    MmapReader *reader = opaque;
+
+    if (mmap_reader_update_file_size(reader))
+        return AVERROR(EIO);
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        /* the size of a file being recorded is meaningless */
+        return reader->follow_timeout > 0. ? AVERROR(ENOSYS): reader->file_size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += reader->pos;
+        break;
+    case SEEK_END:
+        offset += reader->file_size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (offset < 0)
+        return AVERROR(EINVAL);
+    reader->pos = offset;
+    return offset;
+}
+
+static void mmap_reader_close(MmapReader *reader)
+{
+    if (reader->pb) {
+        av_free(reader->pb->buffer);
+        av_free(reader->pb);
+        reader->pb = NULL;
+    }
+    mmap_reader_unmap(reader);
+    if (reader->fd >= 0) {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+}
+
+static int mmap_reader_open(MmapReader *reader, const char *filename, double follow_timeout)
+{
+    struct stat st;
+    unsigned char *buffer;
+
+    reader->map = NULL;
+    reader->map_offset = 0;
+    reader->map_size = 0;
+    reader->pos = 0;
+    reader->advised_pos = 0;
+    reader->page_size = sysconf(_SC_PAGESIZE);
+    reader->follow_timeout = follow_timeout;
+    reader->pb = NULL;
+
+    reader->fd = open(filename, O_RDONLY);
+    if (reader->fd < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open '%s': %s\n", filename, strerror(errno));
+        return 1;
+    }
+    if (fstat(reader->fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        av_log(NULL, AV_LOG_INFO, "'%s' is not a regular file, memory mapping disabled\n", filename);
+        mmap_reader_close(reader);
+        return 1;
+    }
+    reader->file_size = st.st_size;
+
+    buffer = av_malloc(MMAP_READER_BUFFER_SIZE);
+    if (!buffer) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate %d bytes\n", MMAP_READER_BUFFER_SIZE);
+        mmap_reader_close(reader);
+        return 1;
+    }
+    reader->pb = avio_alloc_context(buffer, MMAP_READER_BUFFER_SIZE, 0, reader, mmap_reader_read_packet, NULL, mmap_reader_seek);
+    if (!reader->pb) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate I/O context\n");
+        av_free(buffer);
+        mmap_reader_close(reader);
+        return 1;
+    }
+    if (follow_timeout > 0.)
+        reader->pb->seekable = 0;
+    return 0;
+}
+#endif /* USE_MMAP_READER */
+
+#define DRAIN_READ_SIZE 188 /* the MPEG-TS demuxer reads a packet at a time */
+
+static int64_t drain_input(AVIOContext *pb)
+{
+    unsigned char buf[DRAIN_READ_SIZE];
+    int64_t total = 0;
+    int n;
+    while ((n = avio_read(pb, buf, sizeof(buf))) > 0)
+        total += n;
+    return total;
+}
+
+static void report_throughput(const char *label, int64_t bytes, double elapsed)
+{
+    av_log(NULL, AV_LOG_INFO, "%-8s reader: %"PRId64" bytes in %.3fs (%.1f MB/s)\n", label, bytes, elapsed, elapsed > 0. ? bytes / elapsed / 1e6: 0.);
+}
+
+/*
+ * Reads the whole input through the default file protocol and through the
+ * memory-mapped reader and reports the throughput of each.  Both are read
+ * the way the demuxer reads them, in small reads through AVIO buffers of
+ * the same size.  A warm-up pass is made first so that both readers are
+ * measured against a hot page cache.
+ */
+static int benchmark_input_readers(const char *input)
+{
+#ifdef USE_MMAP_READER
+    AVIOContext *pb = NULL;
+    MmapReader reader;
+    int64_t default_bytes, mmap_bytes;
+    double t, default_elapsed, mmap_elapsed;
+    int pass;
+
+    for (pass = 0; pass < 2; pass++) {
+#ifdef HAVE_AVIO_OPEN
+        if (avio_open(&pb, input, URL_RDONLY) < 0)
+#else
+        if (url_fopen(&pb, input, URL_RDONLY) < 0)
+#endif
+        {
+            av_log(NULL, AV_LOG_ERROR, "Could not open '%s'\n", input);
+            return 1;
+        }
+        t = get_wallclock();
+        default_bytes = drain_input(pb);
+        default_elapsed = get_wallclock() - t;
+#ifdef HAVE_AVIO_CLOSE
+        avio_close(pb);
+#else
+        url_fclose(pb);
+#endif
+    }
+
+    if (mmap_reader_open(&reader, input, 0.))
+        return 1;
+    t = get_wallclock();
+    mmap_bytes = drain_input(reader.pb);
+    mmap_elapsed = get_wallclock() - t;
+    mmap_reader_close(&reader);
+
+    report_throughput("default", default_bytes, default_elapsed);
+    report_throughput("mmap", mmap_bytes, mmap_elapsed);
+    if (default_bytes > 0 && default_elapsed > 0. && mmap_elapsed > 0.)
+        av_log(NULL, AV_LOG_INFO, "mmap reader throughput: %+.1f%% against default reader\n", ((mmap_bytes / mmap_elapsed) / (default_bytes / default_elapsed) - 1.) * 100.);
+    return 0;
+#else
+    av_log(NULL, AV_LOG_ERROR, "Memory-mapped input is not supported on this platform\n");
+    return 1;
+#endif /* USE_MMAP_READER */
+}
+
+typedef struct SegmentInfo {
+    int64_t size;
+    double duration;
+    unsigned int bitrate;
+    uint32_t crc32c;
+    char sha256[65];
+} SegmentInfo;
+
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_update)(uint32_t crc, const uint8_t *p, size_t len);
+
+static uint32_t crc32c_update_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(HAVE_SSE42_CRC32C)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t crc64;
+
+    for (; len > 0 && ((uintptr_t)p & 7); len--)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    crc64 = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, v);
+    }
+    crc = crc64;
+    for (; len > 0; len--)
+        crc = __builtin_ia32_crc32qi(crc, *p++);
+    return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_update_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    for (; len > 0 && ((uintptr_t)p & 7); len--)
+        crc = __crc32cb(crc, *p++);
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+    }
+    for (; len > 0; len--)
+        crc = __crc32cb(crc, *p++);
+    return crc;
+}
+#endif
+
+/* Must be called before any thread is started */
+static void crc32c_init(void)
+{
+    uint32_t i, j;
+
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        crc32c_table[i] = crc;
+    }
+
+    crc32c_update = crc32c_update_sw;
+#if defined(HAVE_SSE42_CRC32C)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_update = crc32c_update_hw;
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    crc32c_update = crc32c_update_hw;
+#endif
+}
+
+#define SEGMENT_OUTPUT_BUFFER_SIZE (64 << 10)
+
+/*
+ * Segment file written through a custom AVIOContext so that the CRC32C
+ * (and optionally the SHA-256) of the segment and its size are computed
+ * over the bytes as they go to disk, without reading the file back.
+ */
+typedef struct SegmentOutput {
+    int fd;
+    AVIOContext *pb;
+    int64_t size;
+    uint32_t crc32c;
+    struct AVSHA *sha;
+} SegmentOutput;
+
+static int segment_output_write_packet(void *opaque, uint8_t *buf, int buf_size)
+{
+    SegmentOutput *out = opaque;
+    const uint8_t *p = buf;
+    size_t remaining = buf_size;
+
+    while (remaining > 0) {
+        ssize_t n = write(out->fd, p, remaining);
+        if (n < 0) {
+            int err = errno;
+            if (err == EINTR)
+                continue;
+            av_log(NULL, AV_LOG_ERROR, "Could not write to segment: %s\n", strerror(err));
+            return AVERROR(err);
+        }
+        p += n;
+        remaining -= n;
+    }
+
+    out->crc32c = crc32c_update(out->crc32c, buf, buf_size);
+    if (out->sha)
+        av_sha_update(out->sha, buf, buf_size);
+    out->size += buf_size;
+    return buf_size;
+}
+
+static int segment_output_open(SegmentOutput *out, const char *filename, int with_sha256)
+{
+    unsigned char *buffer;
+
+    out->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out->fd < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open '%s': %s\n", filename, strerror(errno));
+        return 1;
+    }
+    out->size = 0;
+    out->crc32c = 0xffffffff;
+    out->sha = NULL;
+    if (with_sha256) {
+        out->sha = av_malloc(av_sha_size);
+        if (!out->sha) {
+            av_log(NULL, AV_LOG_ERROR, "Could not allocate %d bytes\n", av_sha_size);
+            goto fail;
+        }
+        av_sha_init(out->sha, 256);
+    }
+
+    buffer = av_malloc(SEGMENT_OUTPUT_BUFFER_SIZE);
+    if (!buffer) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate %d bytes\n", SEGMENT_OUTPUT_BUFFER_SIZE);
+        goto fail;
+    }
+    out->pb = avio_alloc_context(buffer, SEGMENT_OUTPUT_BUFFER_SIZE, 1, out, NULL, segment_output_write_packet, NULL);
+    if (!out->pb) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate I/O context\n");
+        av_free(buffer);
+        goto fail;
+    }
+    return 0;
+fail:
+    if (out->sha)
+        av_freep(&out->sha);
+    close(out->fd);
+    out->fd = -1;
+    return 1;
+}
+
+/* Writes a large buffer straight to the segment, bypassing the I/O buffer */
+static int segment_output_write(SegmentOutput *out, const uint8_t *buf, size_t size)
+{
+    int ret;
+    avio_flush(out->pb);
+    SEGMENTER_PROBE3(write_begin, -1, AV_NOPTS_VALUE, size);
+    ret = segment_output_write_packet(out, (uint8_t *)buf, size);
+    SEGMENTER_PROBE3(write_end, -1, AV_NOPTS_VALUE, ret < 0 ? ret: 0);
+    return ret < 0;
+}
+
+/*
+ * Flushes and closes the segment.  When info is given, its size, crc32c
+ * and sha256 members are filled in.
+ */
+static int segment_output_close(SegmentOutput *out, SegmentInfo *info)
+{
+    int retval = 0;
+
+    if (!out->pb)
+        return 0;
+
+    avio_flush(out->pb);
+    if (out->pb->error < 0)
+        retval = 1;
+
+    if (info) {
+        info->size = out->size;
+        info->crc32c = ~out->crc32c;
+        info->sha256[0] = '\0';
+        if (out->sha) {
+            uint8_t digest[32];
+            int i;
+            av_sha_final(out->sha, digest);
+            for (i = 0; i < 32; i++)
+                snprintf(info->sha256 + i * 2, 3, "%02x", digest[i]);
+        }
+    }
+
+    if (close(out->fd) < 0)
+        retval = 1;
+    out->fd = -1;
+    av_free(out->pb->buffer);
+    av_free(out->pb);
+    out->pb = NULL;
+    if (out->sha)
+        av_freep(&out->sha);
+    return retval;
+}
+
+/* Returns "dir/.name" for "dir/name", used to replace playlists atomically */
+static char *make_tmp_file_name(const char *file)
+{
+    char *tmp_file;
+    const char *dot;
+    size_t dot_index;
+    size_t file_sz = strlen(file);
+
+    tmp_file = xmalloc(file_sz + 2);
+    dot = strrchr(file, '/');
+    dot = dot ? dot + 1: file;
+    dot_index = dot - file;
+    memmove(tmp_file, file, dot_index);
+    tmp_file[dot_index] = '.';
+    memmove(tmp_file + dot_index + 1, file + dot_index, file_sz - dot_index + 1);
+    return tmp_file;
+}
+
 typedef struct IndexFileWriter {
     const char *index_file;
     char *tmp_file;
@@ -224,24 +819,47 @@ typedef struct IndexFileWriter {
     const char *output_ext;
     size_t output_prefix_sz;
     const char *http_prefix;
+    unsigned int first_sequence_num;
     unsigned int sequence_num;
     char *current_ts_file;
+    CharBuffer entries;
+    double max_duration;
+    FILE *manifest_fp;
+    int with_sha256;
 } IndexFileWriter;
 
 static int index_file_writer_finalize(IndexFileWriter *writer) {
     if (writer->fp) {
-        if (fprintf(writer->fp, "#EXT-X-ENDLIST\n") < 0) {
-            av_log(NULL, AV_LOG_ERROR, "Could not write last file and endlist tag to m3u8 index file\n");
-            return 1;
+        /* the target duration must cover the longest segment actually written */
+        unsigned int target_duration = writer->max_duration + 0.5;
+        if (target_duration < writer->segment_duration)
+            target_duration = writer->segment_duration;
+
+        if (fprintf(writer->fp, "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:%u\n", target_duration) < 0)
+            goto err;
+
+        if (writer->first_sequence_num != 1) {
+            if (fprintf(writer->fp, "#EXT-X-MEDIA-SEQUENCE:%u\n", writer->first_sequence_num) < 0)
+                goto err;
         }
+
+        if (writer->entries.len > 0 && fwrite(writer->entries.buf, 1, writer->entries.len, writer->fp) != writer->entries.len)
+            goto err;
+
+        if (fprintf(writer->fp, "#EXT-X-ENDLIST\n") < 0)
+            goto err;
         fclose(writer->fp);
         writer->fp = NULL;
         rename(writer->tmp_file, writer->index_file);
+        SEGMENTER_PROBE2(playlist_publish, writer->index_file, writer->sequence_num - writer->first_sequence_num);
         if (writer->tmp_file)
             free(writer->tmp_file);
         writer->tmp_file = NULL; 
     }
     return 0;
+err:
+    av_log(NULL, AV_LOG_ERROR, "Could not write last file and endlist tag to m3u8 index file\n");
+    return 1;
 }
 
 static void index_file_writer_free(IndexFileWriter *writer) {
@@ -254,35 +872,61 @@ static void index_file_writer_free(IndexFileWriter *writer) {
     if (writer->current_ts_file) {
         free(writer->current_ts_file);
     }
+    if (writer->manifest_fp)
+        fclose(writer->manifest_fp);
+    char_buffer_free(&writer->entries);
 }
 
 static int index_file_writer_init(IndexFileWriter *writer, const char *index_file, unsigned int segment_duration, const char *output_prefix, const char *output_ext, const char *http_prefix, unsigned int first_sequence_num) {
-    char *tmp_file;
-
-    {
-        const char *dot;
-        size_t dot_index;
-        size_t index_file_sz = strlen(index_file);
-
-        tmp_file = xmalloc(index_file_sz + 2);
-        dot = strrchr(index_file, '/');
-        dot = dot ? dot + 1: index_file;
-        dot_index = dot - index_file;
-        memmove(tmp_file, index, dot_index);
-        tmp_file[dot_index] = '.';
-        memmove(tmp_file + dot_index + 1, index + dot_index, index_file_sz - dot_index);
-    }
-
     writer->index_file = index_file;
-    writer->tmp_file = tmp_file;
+    writer->tmp_file = make_tmp_file_name(index_file);
     writer->fp = NULL;
     writer->segment_duration = segment_duration;
     writer->output_prefix = output_prefix;
     writer->output_prefix_sz = strlen(output_prefix);
     writer->output_ext = output_ext;
     writer->http_prefix = http_prefix;
+    writer->first_sequence_num = first_sequence_num;
     writer->sequence_num = first_sequence_num;
     writer->current_ts_file = NULL;
+    writer->entries.buf = NULL;
+    writer->entries.len = 0;
+    writer->entries.alloc = 0;
+    writer->max_duration = 0.;
+    writer->manifest_fp = NULL;
+    writer->with_sha256 = 0;
+    return 0;
+}
+
+/*
+ * Opens a sidecar manifest next to the index file ("foo.m3u8" gets
+ * "foo.manifest") listing the size, duration, bitrate and checksums of each
+ * segment as it is completed.
+ */
+static int index_file_writer_open_manifest(IndexFileWriter *writer, int with_sha256)
+{
+    size_t len = strlen(writer->index_file);
+    char *manifest_file;
+
+    if (len >= 5 && !strcmp(writer->index_file + len - 5, ".m3u8"))
+        len -= 5;
+    manifest_file = xmalloc(len + sizeof(".manifest"));
+    memmove(manifest_file, writer->index_file, len);
+    memmove(manifest_file + len, ".manifest", sizeof(".manifest"));
+
+    writer->manifest_fp = fopen(manifest_file, "w");
+    if (!writer->manifest_fp) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open segment manifest (%s)\n", manifest_file);
+        free(manifest_file);
+        return 1;
+    }
+    free(manifest_file);
+    writer->with_sha256 = with_sha256;
+
+    if (fprintf(writer->manifest_fp, with_sha256 ? "# file size duration bitrate crc32c sha256\n": "# file size duration bitrate crc32c\n") < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not write to segment manifest\n");
+        return 1;
+    }
     return 0;
 }
 
@@ -303,511 +947,2234 @@ static int index_file_writer_begin(IndexFileWriter *writer)
         av_log(NULL, AV_LOG_ERROR, "Could not open temporary m3u8 index file (%s), no index file will be created\n", writer->tmp_file);
         return 1;
     }
-    if (fprintf(writer->fp, "#EXTM3U\n") < 0)
-        goto err;
 
-    if (fprintf(writer->fp, "#EXT-X-TARGETDURATION:%u\n", writer->segment_duration) < 0)
-        goto err;
+    return index_file_writer_populate_current_ts_file(writer);
+}
 
-    if (writer->sequence_num != 1) {
-        if (fprintf(writer->fp, "#EXT-X-MEDIA-SEQUENCE:%u\n", writer->sequence_num) < 0)
+static int index_file_writer_write_index(IndexFileWriter *writer, const SegmentInfo *info)
+{
+    if (info->bitrate > 0) {
+        if (char_buffer_printf(&writer->entries, "#EXT-X-BITRATE:%u\n", (info->bitrate + 500) / 1000) < 0)
             goto err;
     }
+    if (char_buffer_printf(&writer->entries, "#EXTINF:%.3f,\n%s%s\n", info->duration, writer->http_prefix, writer->current_ts_file) < 0)
+        goto err;
+    if (info->duration > writer->max_duration)
+        writer->max_duration = info->duration;
+
+    if (writer->manifest_fp) {
+        if (fprintf(writer->manifest_fp, "%s %"PRId64" %.3f %u %08x", writer->current_ts_file, info->size, info->duration, info->bitrate, info->crc32c) < 0)
+            goto manifest_err;
+        if (writer->with_sha256 && fprintf(writer->manifest_fp, " %s", info->sha256) < 0)
+            goto manifest_err;
+        if (fprintf(writer->manifest_fp, "\n") < 0 || fflush(writer->manifest_fp))
+            goto manifest_err;
+    }
 
+    writer->sequence_num++;
     return index_file_writer_populate_current_ts_file(writer);
+manifest_err:
+    av_log(NULL, AV_LOG_ERROR, "Could not write to segment manifest\n");
+    fclose(writer->manifest_fp);
+    writer->manifest_fp = NULL;
+    writer->sequence_num++;
+    index_file_writer_populate_current_ts_file(writer);
+    return 1;
 err:
     av_log(NULL, AV_LOG_ERROR, "Could not write to m3u8 index file, will not continue writing to index file\n");
     return 1;
 }
 
-static int index_file_writer_write_index(IndexFileWriter *writer, unsigned int duration)
+#define AUDIO_FRAME_READER_BUFFER_SIZE (16 << 10)
+#define AUDIO_FRAME_HEADER_SIZE 10 /* enough for an ID3v2, ADTS or MP3 header */
+#define AUDIO_FRAME_MIN_HEADER_SIZE 7 /* what parse_audio_frame_header() reads */
+
+enum AudioFormat {
+    AUDIO_FORMAT_NONE,
+    AUDIO_FORMAT_MP3,
+    AUDIO_FORMAT_ADTS
+};
+
+typedef struct AudioFrameHeader {
+    enum AudioFormat format;
+    int size;
+    int sample_rate;
+    int samples;
+} AudioFrameHeader;
+
+static const unsigned short mp3_bitrates[5][15] = {
+    { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 }, /* MPEG-1 layer I */
+    { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },    /* MPEG-1 layer II */
+    { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },    /* MPEG-1 layer III */
+    { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },   /* MPEG-2/2.5 layer I */
+    { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }         /* MPEG-2/2.5 layer II, III */
+};
+
+static const unsigned int mp3_sample_rates[3] = { 44100, 48000, 32000 };
+
+static const unsigned int adts_sample_rates[13] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+};
+
+static int parse_mp3_frame_header(const uint8_t *p, AudioFrameHeader *hdr)
 {
-    if (fprintf(writer->fp, "#EXTINF:%u,\n%s%s\n", duration, writer->http_prefix, writer->current_ts_file) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Could not write to m3u8 index file, will not continue writing to index file\n");
+    int version = (p[1] >> 3) & 3; /* 0: MPEG-2.5, 2: MPEG-2, 3: MPEG-1 */
+    int layer = 4 - ((p[1] >> 1) & 3);
+    int bitrate_index = p[2] >> 4;
+    int sample_rate_index = (p[2] >> 2) & 3;
+    int padding = (p[2] >> 1) & 1;
+    unsigned int bitrate;
+
+    if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0 || version == 1 || layer == 4 ||
+            bitrate_index == 0 || bitrate_index == 15 || sample_rate_index == 3)
         return 1;
+
+    bitrate = mp3_bitrates[version == 3 ? layer - 1: (layer == 1 ? 3: 4)][bitrate_index] * 1000;
+    hdr->format = AUDIO_FORMAT_MP3;
+    hdr->sample_rate = mp3_sample_rates[sample_rate_index] >> (version == 3 ? 0: version == 2 ? 1: 2);
+    switch (layer) {
+    case 1:
+        hdr->samples = 384;
+        hdr->size = (12 * bitrate / hdr->sample_rate + padding) * 4;
+        break;
+    case 2:
+        hdr->samples = 1152;
+        hdr->size = 144 * bitrate / hdr->sample_rate + padding;
+        break;
+    default:
+        hdr->samples = version == 3 ? 1152: 576;
+        hdr->size = hdr->samples / 8 * bitrate / hdr->sample_rate + padding;
+        break;
     }
-    writer->sequence_num++;
-    return index_file_writer_populate_current_ts_file(writer);
+    return 0;
 }
 
-int main(int argc, char **argv)
+static int parse_adts_frame_header(const uint8_t *p, AudioFrameHeader *hdr)
 {
-    const char *input;
-    const char *input_ext = NULL;
-    char *output_prefix = NULL;
-    const char *input_format_str = NULL;
-    const char *output_format_str = "mpegts";
-    char output_ext[1024] = "ts";
-    double segment_duration;
-    char *segment_duration_check;
-    const char *index;
-    const char *http_prefix;
-    long max_tsfiles = 0;
-    char *max_tsfiles_check;
-    CharPtrArray bs_filter_names = { 0, 0, 0 };
-    AVInputFormat *input_format = NULL;
-    AVOutputFormat *output_format = NULL;
-    AVBitStreamFilterContext **bs_filters = NULL;
-    AVFormatContext *ic = NULL;
-    AVFormatContext *oc = NULL;
-    AVStream *video_st = NULL;
-    AVStream *audio_st = NULL;
-    int video_index, audio_index;
-    IndexFileWriter writer;
-    double frame_time = 0., video_frame_time = 0., audio_frame_time = 0., last_frame_time = 0.;
-    int ret;
-    int i;
-    int err = 0;
-    const char *progname = argv[0];
+    int sample_rate_index = (p[2] >> 2) & 0xf;
+    int size = ((p[3] & 3) << 11) | (p[4] << 3) | (p[5] >> 5);
 
-    {
-        int optch;
-        while ((optch = getopt(argc, argv, "e:f:p:x:")) != -1) {
-            switch (optch) {
-            case 'e':
-                /* format */
-                input_format_str = optarg;
-                break;
-            case 'f':
-                /* format */
-                output_format_str = optarg;
-                break;
-            case 'p':
-                /* prefix */
-                if (output_prefix)
-                    free(output_prefix);
-                output_prefix = xstrdup(optarg);
-                break;
-            case 'x':
-                /* filter */
-                char_ptr_array_append(&bs_filter_names, (char *)optarg);
-                break;
-            }
-        }
-    }
-    argc -= optind;
-    argv += optind;
-
-    if (argc < 4 || argc > 5) {
-        av_log(NULL, AV_LOG_ERROR, "Usage: %s [-e input_format] [-f output_format] [-p output_prefix] [-x filter] <input MPEG-TS / MP3 file> <segment duration in seconds> <output m3u8 index file> <http prefix> [<segment window size>]\n", progname);
-        if (output_prefix)
-            free(output_prefix);
+    if (p[0] != 0xff || (p[1] & 0xf6) != 0xf0 || sample_rate_index >= 13 || size < 7)
         return 1;
+
+    hdr->format = AUDIO_FORMAT_ADTS;
+    hdr->sample_rate = adts_sample_rates[sample_rate_index];
+    hdr->samples = ((p[6] & 3) + 1) * 1024;
+    hdr->size = size;
+    return 0;
+}
+
+/*
+ * Parses the header of an MP3 or ADTS frame at p.  Once the format of the
+ * stream is known, only headers of that format are accepted.
+ */
+static int parse_audio_frame_header(const uint8_t *p, enum AudioFormat format, AudioFrameHeader *hdr)
+{
+    if (format != AUDIO_FORMAT_MP3 && !parse_adts_frame_header(p, hdr))
+        return 0;
+    if (format != AUDIO_FORMAT_ADTS && !parse_mp3_frame_header(p, hdr))
+        return 0;
+    return 1;
+}
+
+/*
+ * Reads MP3 or ADTS frames from an I/O context with a small fixed buffer,
+ * skipping ID3v2 tags and resynchronizing on garbage.  A frame is accepted
+ * on resynchronization only if it is followed by another valid header.
+ */
+typedef struct AudioFrameReader {
+    AVIOContext *pb;
+    uint8_t *buf;
+    size_t pos;
+    size_t len;
+    int eof;
+    int synced;
+    enum AudioFormat format;
+} AudioFrameReader;
+
+static void audio_frame_reader_init(AudioFrameReader *reader, AVIOContext *pb)
+{
+    reader->pb = pb;
+    reader->buf = xmalloc(AUDIO_FRAME_READER_BUFFER_SIZE);
+    reader->pos = 0;
+    reader->len = 0;
+    reader->eof = 0;
+    reader->synced = 0;
+    reader->format = AUDIO_FORMAT_NONE;
+}
+
+static void audio_frame_reader_free(AudioFrameReader *reader)
+{
+    if (reader->buf)
+        free(reader->buf);
+    reader->buf = NULL;
+}
+
+/* Returns non-zero if fewer than need bytes could be buffered */
+static int audio_frame_reader_fill(AudioFrameReader *reader, size_t need)
+{
+    if (reader->len - reader->pos >= need)
+        return 0;
+    memmove(reader->buf, reader->buf + reader->pos, reader->len - reader->pos);
+    reader->len -= reader->pos;
+    reader->pos = 0;
+    while (!reader->eof && reader->len < need) {
+        int n = avio_read(reader->pb, reader->buf + reader->len, AUDIO_FRAME_READER_BUFFER_SIZE - reader->len);
+        if (n <= 0)
+            reader->eof = 1;
+        else
+            reader->len += n;
     }
+    return reader->len < need;
+}
 
-    av_register_all();
+static void audio_frame_reader_skip(AudioFrameReader *reader, size_t n)
+{
+    while (n > reader->len - reader->pos) {
+        n -= reader->len - reader->pos;
+        reader->pos = reader->len;
+        if (audio_frame_reader_fill(reader, 1))
+            return;
+    }
+    reader->pos += n;
+}
 
-    input = argv[0];
-    if (!strcmp(input, "-")) {
-        input = "pipe:";
-        if (!output_prefix) {
-            av_log(NULL, AV_LOG_ERROR, "Please specify output prefix\n");
-            err = 1;
-            goto out;
+/*
+ * Returns the next frame in *data and its header in *hdr; *data stays valid
+ * until the next call.  Returns non-zero at the end of the input.
+ */
+static int audio_frame_reader_next(AudioFrameReader *reader, AudioFrameHeader *hdr, const uint8_t **data)
+{
+    int64_t skipped = 0;
+
+    for (;;) {
+        const uint8_t *p;
+        AudioFrameHeader next;
+
+        if (audio_frame_reader_fill(reader, AUDIO_FRAME_HEADER_SIZE) && reader->len - reader->pos < AUDIO_FRAME_MIN_HEADER_SIZE)
+            return 1;
+        p = reader->buf + reader->pos;
+
+        if (p[0] == 'I' && p[1] == 'D' && p[2] == '3' && reader->len - reader->pos >= 10) {
+            size_t size = 10 + ((p[6] & 0x7f) << 21 | (p[7] & 0x7f) << 14 | (p[8] & 0x7f) << 7 | (p[9] & 0x7f));
+            if (p[5] & 0x10)
+                size += 10; /* footer */
+            audio_frame_reader_skip(reader, size);
+            continue;
         }
-    } else {
-        const char *input_basename = basename((char *)input);
-        const char *p = strchr(input_basename, '.');
-        if (!p) {
-            if (!output_prefix)
-                output_prefix = xstrdup(input_basename);
-        } else {
-            input_ext = p + 1;
-            if (!output_prefix) {
-                size_t len = p - input_basename;
-                output_prefix = xmalloc(len + 1);
-                memmove(output_prefix, input_basename, len);
-                output_prefix[len] = '\0';
+
+        if (!parse_audio_frame_header(p, reader->format, hdr)) {
+            int short_read = audio_frame_reader_fill(reader, hdr->size + AUDIO_FRAME_HEADER_SIZE);
+            /* whether a whole header of the next frame is buffered to be checked */
+            int has_next = reader->len - reader->pos >= (size_t)hdr->size + AUDIO_FRAME_MIN_HEADER_SIZE;
+            p = reader->buf + reader->pos;
+            if (reader->len - reader->pos < (size_t)hdr->size)
+                return 1;
+            if (reader->synced || (short_read && !has_next) ||
+                    (has_next && !parse_audio_frame_header(p + hdr->size, hdr->format, &next) && next.sample_rate == hdr->sample_rate)) {
+                if (skipped > 0)
+                    av_log(NULL, AV_LOG_WARNING, "Skipped %"PRId64" bytes to find an audio frame\n", skipped);
+                reader->synced = 1;
+                reader->format = hdr->format;
+                *data = p;
+                reader->pos += hdr->size;
+                return 0;
             }
         }
+
+        reader->synced = 0;
+        reader->pos++;
+        skipped++;
     }
+}
 
-    segment_duration = strtod(argv[1], &segment_duration_check);
-    if (segment_duration_check == argv[1] || segment_duration == HUGE_VAL || segment_duration == -HUGE_VAL) {
-        av_log(NULL, AV_LOG_ERROR, "Segment duration time (%s) invalid\n", argv[1]);
-        return 1;
+#define TS_PACKET_SIZE 188
+#define TS_SYNC_BYTE 0x47
+#define TS_READER_BUFFER_SIZE (TS_PACKET_SIZE * 2048)
+#define TS_PTS_WRAP (INT64_C(1) << 33)
+#define TS_RAP_SCAN_PACKETS 64 /* packets looked ahead for the picture type */
+#define TS_RAP_SCAN_SIZE 4096 /* elementary stream bytes looked at */
+
+/*
+ * Reads MPEG-TS as whole 188-byte packets and keeps track of the PAT and
+ * PMT, so that segments can be cut out of the input without demuxing.
+ */
+typedef struct TsReader {
+    AVIOContext *pb;
+    uint8_t *buf;
+    size_t pos;
+    size_t len;
+    size_t last_read; /* bytes read by the last refill */
+    int eof;
+    int pmt_pid;
+    int cut_pid;
+    int cut_stream_type;
+    uint8_t pat[TS_PACKET_SIZE];
+    uint8_t pmt[TS_PACKET_SIZE];
+    int have_pat;
+    int have_pmt;
+    int64_t last_pts;
+    int64_t pts_offset;
+    int64_t max_pts;
+    int64_t frame_duration; /* smallest positive PTS step, in 90 kHz units */
+} TsReader;
+
+static void ts_reader_init(TsReader *reader, AVIOContext *pb)
+{
+    reader->pb = pb;
+    reader->buf = xmalloc(TS_READER_BUFFER_SIZE);
+    reader->pos = 0;
+    reader->len = 0;
+    reader->last_read = 0;
+    reader->eof = 0;
+    reader->pmt_pid = -1;
+    reader->cut_pid = -1;
+    reader->cut_stream_type = 0;
+    reader->have_pat = 0;
+    reader->have_pmt = 0;
+    reader->last_pts = AV_NOPTS_VALUE;
+    reader->pts_offset = 0;
+    reader->max_pts = AV_NOPTS_VALUE;
+    reader->frame_duration = 0;
+}
+
+static void ts_reader_free(TsReader *reader)
+{
+    if (reader->buf)
+        free(reader->buf);
+    reader->buf = NULL;
+}
+
+/* Returns non-zero if fewer than need bytes could be buffered */
+static int ts_reader_fill(TsReader *reader, size_t need)
+{
+    if (reader->len - reader->pos >= need)
+        return 0;
+    memmove(reader->buf, reader->buf + reader->pos, reader->len - reader->pos);
+    reader->len -= reader->pos;
+    reader->pos = 0;
+    reader->last_read = 0;
+    while (!reader->eof && reader->len < need) {
+        int n = avio_read(reader->pb, reader->buf + reader->len, TS_READER_BUFFER_SIZE - reader->len);
+        if (n <= 0) {
+            reader->eof = 1;
+        } else {
+            reader->len += n;
+            reader->last_read += n;
+        }
     }
-    index = argv[2];
-    http_prefix=argv[3];
-    if (argc == 5) {
-        max_tsfiles = strtol(argv[4], &max_tsfiles_check, 10);
-        if (max_tsfiles_check == argv[4] || max_tsfiles < 0 || max_tsfiles >= INT_MAX) {
-            av_log(NULL, AV_LOG_ERROR, "Maximum number of ts files (%s) invalid\n", argv[4]);
-            return 1;
+    return reader->len < need;
+}
+
+static int ts_sync_at(const uint8_t *p, size_t len, size_t i)
+{
+    return (i + TS_PACKET_SIZE >= len || p[i + TS_PACKET_SIZE] == TS_SYNC_BYTE) &&
+        (i + TS_PACKET_SIZE * 2 >= len || p[i + TS_PACKET_SIZE * 2] == TS_SYNC_BYTE);
+}
+
+/*
+ * Returns the offset of the first sync byte in p that is followed by two
+ * more at packet distance, or len if there is none.
+ */
+static size_t ts_find_sync(const uint8_t *p, size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i sync = _mm_set1_epi8(TS_SYNC_BYTE);
+    for (; i + 16 <= len; i += 16) {
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), sync));
+        while (mask) {
+            size_t j = i + __builtin_ctz(mask);
+            if (ts_sync_at(p, len, j))
+                return j;
+            mask &= mask - 1;
         }
     }
+#endif /* __SSE2__ */
+    for (; i < len; i++) {
+        if (p[i] == TS_SYNC_BYTE && ts_sync_at(p, len, i))
+            return i;
+    }
+    return len;
+}
 
-    if (index_file_writer_init(&writer, index, segment_duration, output_prefix, output_ext, http_prefix, 1)) {
-        return 1;
+/* Returns the PSI section in the payload of a packet starting one, or NULL */
+static const uint8_t *ts_psi_section(const uint8_t *payload, const uint8_t *end, int table_id, int *section_length)
+{
+    const uint8_t *section = payload + 1 + payload[0];
+    if (section + 3 > end || section[0] != table_id)
+        return NULL;
+    *section_length = ((section[1] & 0x0f) << 8) | section[2];
+    /* sections spanning several packets are not supported */
+    if (section + 3 + *section_length > end || *section_length < 9)
+        return NULL;
+    return section;
+}
+
+static void ts_reader_parse_pat(TsReader *reader, const uint8_t *payload, const uint8_t *end)
+{
+    int section_length;
+    const uint8_t *section = ts_psi_section(payload, end, 0x00, &section_length);
+    const uint8_t *p, *programs_end;
+
+    if (!section)
+        return;
+    programs_end = section + 3 + section_length - 4;
+    for (p = section + 8; p + 4 <= programs_end; p += 4) {
+        int program_number = (p[0] << 8) | p[1];
+        if (program_number != 0) {
+            reader->pmt_pid = ((p[2] & 0x1f) << 8) | p[3];
+            return;
+        }
     }
+}
 
-    if (input_format_str) {
-        input_format = av_find_input_format(input_format_str);
-        if (!input_format) {
-            av_log(NULL, AV_LOG_ERROR, "Specified input file format is not supported.\n");
-            err = 1;
-            goto out;
+static int ts_is_video_stream_type(int stream_type)
+{
+    return stream_type == 0x01 || stream_type == 0x02 || stream_type == 0x10 || stream_type == 0x1b || stream_type == 0x24;
+}
+
+static void ts_reader_parse_pmt(TsReader *reader, const uint8_t *payload, const uint8_t *end)
+{
+    int section_length;
+    const uint8_t *section = ts_psi_section(payload, end, 0x02, &section_length);
+    const uint8_t *p, *streams_end;
+    int cut_pid = -1, cut_stream_type = 0;
+
+    if (!section || section_length < 13)
+        return;
+    streams_end = section + 3 + section_length - 4;
+    for (p = section + 12 + (((section[10] & 0x0f) << 8) | section[11]); p + 5 <= streams_end; p += 5 + (((p[3] & 0x0f) << 8) | p[4])) {
+        int stream_type = p[0];
+        int pid = ((p[1] & 0x1f) << 8) | p[2];
+        /* cut on the first video stream, or on the first stream if there is none */
+        if (ts_is_video_stream_type(stream_type)) {
+            cut_pid = pid;
+            cut_stream_type = stream_type;
+            break;
         }
-    } else {
-        input_format = guess_input_format_from_filename(input);
-        if (!input_format) {
-            av_log(NULL, AV_LOG_INFO, "Could not determine input file format. MPEG-TS assumed\n");
-            input_format = av_find_input_format("mpegts");
-            if (!input_format) {
-                av_log(NULL, AV_LOG_ERROR, "Could not find MPEG-TS demuxer\n");
-                err = 1;
-                goto out;
-            }
+        if (cut_pid < 0) {
+            cut_pid = pid;
+            cut_stream_type = stream_type;
         }
     }
+    if (cut_pid >= 0 && cut_pid != reader->cut_pid) {
+        av_log(NULL, AV_LOG_VERBOSE, "Cutting on PID 0x%x (stream type 0x%02x)\n", cut_pid, cut_stream_type);
+        reader->cut_pid = cut_pid;
+        reader->cut_stream_type = cut_stream_type;
+    }
+}
 
-#ifdef HAVE_AVFORMAT_OPEN_INPUT
-    ret = avformat_open_input(&ic, input, input_format, NULL);
-#else
-    ret = av_open_input_file(&ic, input, input_format, 0, NULL);
-#endif /* HAVE_AVFORMAT_OPEN_INPUT */
-    if (ret != 0) {
-        char buf[1024];
-#ifdef HAVE_AV_STRERROR
-        av_strerror(ret, buf, sizeof(buf));
-#else
-        snprintf(buf, sizeof(buf), "%d", ret);
-#endif /* HAVE_AV_STRERROR */
+/*
+ * Looks at the start of an access unit for its first picture, and returns
+ * whether that is an IDR/IRAP picture (H.264, HEVC), an I-VOP (MPEG-4
+ * Part 2) or preceded by a sequence header (MPEG-2).  Parameter sets,
+ * AUDs and SEI before the picture are skipped.
+ */
+static int ts_es_is_random_access(int stream_type, const uint8_t *p, const uint8_t *end)
+{
+    for (; p + 5 <= end; p++) {
+        if (p[0] != 0 || p[1] != 0 || p[2] != 1)
+            continue;
+        switch (stream_type) {
+        case 0x1b: {
+            int nal_type = p[3] & 0x1f;
+            if (nal_type >= 1 && nal_type <= 5)
+                return nal_type == 5;
+            break;
+        }
+        case 0x24: {
+            int nal_type = (p[3] >> 1) & 0x3f;
+            if (nal_type < 32)
+                return nal_type >= 16 && nal_type <= 21;
+            break;
+        }
+        case 0x01:
+        case 0x02:
+            if (p[3] == 0xb3) /* sequence header */
+                return 1;
+            if (p[3] == 0x00) /* picture */
+                return 0;
+            break;
+        case 0x10:
+            if (p[3] == 0xb6) /* VOP, vop_coding_type 0 is intra */
+                return (p[4] >> 6) == 0;
+            break;
+        default:
+            break;
+        }
+    }
+    return 0;
+}
 
-        av_log(NULL, AV_LOG_ERROR, "Could not open input file, make sure it is %s file: %s\n", input_format->long_name, buf);
-        err = 1;
-        goto out;
+/*
+ * Copies the elementary stream bytes of the PES packet starting in the
+ * current packet into buf, from es on and then from the following packets
+ * of the cut PID, up to TS_RAP_SCAN_PACKETS packets ahead.
+ */
+static size_t ts_reader_gather_es(const TsReader *reader, const uint8_t *es, const uint8_t *end, uint8_t *buf, size_t size)
+{
+    const uint8_t *p = reader->buf + reader->pos + TS_PACKET_SIZE;
+    const uint8_t *buf_end = reader->buf + reader->len;
+    size_t n = 0;
+    int i;
+
+    if (es < end) {
+        n = end - es < size ? end - es: size;
+        memcpy(buf, es, n);
+    }
+    for (i = 0; i < TS_RAP_SCAN_PACKETS && n < size && p + TS_PACKET_SIZE <= buf_end; i++, p += TS_PACKET_SIZE) {
+        const uint8_t *payload = p + 4;
+        size_t len;
+        if (p[0] != TS_SYNC_BYTE)
+            break;
+        if ((((p[1] & 0x1f) << 8) | p[2]) != reader->cut_pid || !(p[3] & 0x10))
+            continue;
+        if (p[1] & 0x40) /* the next PES packet */
+            break;
+        if (p[3] & 0x20)
+            payload += 1 + p[4];
+        if (payload >= p + TS_PACKET_SIZE)
+            continue;
+        len = p + TS_PACKET_SIZE - payload;
+        if (len > size - n)
+            len = size - n;
+        memcpy(buf + n, payload, len);
+        n += len;
     }
+    return n;
+}
 
-#ifdef HAVE_AVFORMAT_FIND_STREAM_INFO
-    if (avformat_find_stream_info(ic, NULL) < 0)
-#else
-    if (av_find_stream_info(ic) < 0)
-#endif /* HAVE_AVFORMAT_FIND_STREAM_INFO */
+/*
+ * Examines a packet of the cut PID that starts a PES packet.  Returns its
+ * PTS in seconds in *frame_time and whether it is a random access point.
+ */
+static int ts_reader_parse_pes(TsReader *reader, const uint8_t *payload, const uint8_t *end, int random_access, double *frame_time)
+{
+    int64_t pts;
+
+    if (payload + 14 > end || payload[0] != 0 || payload[1] != 0 || payload[2] != 1 || !(payload[7] & 0x80))
+        return 0;
+    pts = (int64_t)((payload[9] >> 1) & 7) << 30 | payload[10] << 22 | (payload[11] >> 1) << 15 | payload[12] << 7 | payload[13] >> 1;
+
+    /* unwrap the 33-bit timestamps */
+    if (reader->last_pts != AV_NOPTS_VALUE) {
+        if (pts + reader->pts_offset < reader->last_pts - TS_PTS_WRAP / 2)
+            reader->pts_offset += TS_PTS_WRAP;
+        else if (pts + reader->pts_offset > reader->last_pts + TS_PTS_WRAP / 2 && reader->pts_offset >= TS_PTS_WRAP)
+            reader->pts_offset -= TS_PTS_WRAP;
+    }
+    pts += reader->pts_offset;
+    if (reader->last_pts != AV_NOPTS_VALUE && pts > reader->last_pts &&
+            (!reader->frame_duration || pts - reader->last_pts < reader->frame_duration))
+        reader->frame_duration = pts - reader->last_pts;
+    if (reader->max_pts == AV_NOPTS_VALUE || pts > reader->max_pts)
+        reader->max_pts = pts;
+    reader->last_pts = pts;
+    *frame_time = pts / 90000.;
+
+    if (random_access || !ts_is_video_stream_type(reader->cut_stream_type))
+        return 1;
     {
-        av_log(NULL, AV_LOG_ERROR, "Could not read stream information\n");
-        err = 1;
-        goto out;
+        uint8_t es[TS_RAP_SCAN_SIZE];
+        size_t n = ts_reader_gather_es(reader, payload + 9 + payload[8], end, es, sizeof(es));
+        return ts_es_is_random_access(reader->cut_stream_type, es, es + n);
     }
+}
 
-    output_format = av_guess_format(output_format_str, NULL, NULL);
-    if (!output_format) {
-        av_log(NULL, AV_LOG_ERROR, "Could not find MPEG-TS muxer\n");
-        err = 1;
-        goto out;
+enum InterleavePolicy {
+    INTERLEAVE_FLUSH,
+    INTERLEAVE_DROP,
+    INTERLEAVE_GAP
+};
+
+typedef struct PacketListEntry {
+    AVPacket pkt;
+    struct PacketListEntry *next;
+} PacketListEntry;
+
+typedef struct PacketQueue {
+    PacketListEntry *head;
+    PacketListEntry *tail;
+    size_t bytes;
+    double time_base;
+    int gap;
+} PacketQueue;
+
+/*
+ * Interleaves packets by DTS before they reach the muxer, in place of
+ * av_interleaved_write_frame(), whose internal queue grows without bound
+ * while one of the streams has no packets.  Each stream's queue is capped
+ * in bytes and in the duration it spans; when a cap is hit, the policy
+ * decides whether the queue is written out early, its oldest packets are
+ * dropped, or the streams without packets stop being waited for until
+ * they come back (a gap, recorded in the index file).
+ */
+typedef struct Interleaver {
+    AVFormatContext *oc;
+    IndexFileWriter *writer;
+    PacketQueue *queues;
+    unsigned int nqueues;
+    size_t max_bytes;
+    double max_duration;
+    enum InterleavePolicy policy;
+    size_t bytes;
+    size_t peak_bytes;
+    int64_t dropped;
+} Interleaver;
+
+static double packet_time(const AVPacket *pkt, double time_base)
+{
+    return (pkt->dts != AV_NOPTS_VALUE ? pkt->dts: pkt->pts) * time_base;
+}
+
+static void interleaver_init(Interleaver *il, AVFormatContext *oc, IndexFileWriter *writer, size_t max_bytes, double max_duration, enum InterleavePolicy policy)
+{
+    unsigned int i;
+
+    il->oc = oc;
+    il->writer = writer;
+    il->nqueues = oc->nb_streams;
+    il->queues = xcalloc(il->nqueues, sizeof(*il->queues));
+    for (i = 0; i < il->nqueues; i++)
+        il->queues[i].time_base = av_q2d(oc->streams[i]->time_base);
+    il->max_bytes = max_bytes;
+    il->max_duration = max_duration;
+    il->policy = policy;
+    il->bytes = 0;
+    il->peak_bytes = 0;
+    il->dropped = 0;
+}
+
+static AVPacket *interleaver_pop(Interleaver *il, PacketQueue *q, AVPacket *pkt)
+{
+    PacketListEntry *entry = q->head;
+    *pkt = entry->pkt;
+    q->head = entry->next;
+    if (!q->head)
+        q->tail = NULL;
+    q->bytes -= pkt->size;
+    il->bytes -= pkt->size;
+    free(entry);
+    return pkt;
+}
+
+static int interleaver_write_head(Interleaver *il, PacketQueue *q)
+{
+    AVPacket pkt;
+    int ret;
+
+    interleaver_pop(il, q, &pkt);
+    SEGMENTER_PROBE3(write_begin, pkt.stream_index, pkt.pts, pkt.size);
+    ret = av_write_frame(il->oc, &pkt);
+    SEGMENTER_PROBE3(write_end, pkt.stream_index, pkt.pts, ret);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "Warning: Could not write frame of stream\n");
+    av_free_packet(&pkt);
+    return ret;
+}
+
+/*
+ * Writes queued packets in DTS order for as long as every stream that is
+ * waited for has one; with all set, until the queues are empty.
+ */
+static int interleaver_drain(Interleaver *il, int all)
+{
+    for (;;) {
+        PacketQueue *next = NULL;
+        double next_time = 0.;
+        unsigned int i;
+        int ret;
+
+        for (i = 0; i < il->nqueues; i++) {
+            PacketQueue *q = &il->queues[i];
+            double t;
+            if (!q->head) {
+                if (!all && !q->gap)
+                    return 0;
+                continue;
+            }
+            t = packet_time(&q->head->pkt, q->time_base);
+            if (!next || t < next_time) {
+                next = q;
+                next_time = t;
+            }
+        }
+        if (!next)
+            return 0;
+        ret = interleaver_write_head(il, next);
+        if (ret > 0)
+            return ret;
     }
-    if (output_format->extensions) {
-        const char *extensions = output_format->extensions, *p;
-        const char *end = extensions + strlen(extensions);
-        const char *sep;
-        for (p = extensions; p; p = sep == end ? NULL: sep + 1) {
-            sep = strchr(p, ',');
-            if (!sep)
-                sep = end;
-            assert(sep - p > 0);
-            /* Use the same extension as the input file if possible */
-            if (input_ext && (strncmp(p, input_ext, sep - p) == 0 || p == extensions)) {
-                strncpy(output_ext, p, sep - p);
-                output_ext[sep - p] = '\0';
+}
+
+static int interleaver_over_cap(const Interleaver *il, const PacketQueue *q)
+{
+    if (!q->head)
+        return 0;
+    if (il->max_bytes && q->bytes > il->max_bytes)
+        return 1;
+    return il->max_duration > 0. &&
+        packet_time(&q->tail->pkt, q->time_base) - packet_time(&q->head->pkt, q->time_base) > il->max_duration;
+}
+
+static int interleaver_enforce_cap(Interleaver *il, PacketQueue *q)
+{
+    unsigned int i;
+    int ret = 0;
+
+    switch (il->policy) {
+    case INTERLEAVE_FLUSH:
+        while (ret <= 0 && interleaver_over_cap(il, q))
+            ret = interleaver_write_head(il, q);
+        break;
+    case INTERLEAVE_DROP:
+        while (interleaver_over_cap(il, q)) {
+            AVPacket pkt;
+            av_free_packet(interleaver_pop(il, q, &pkt));
+            il->dropped++;
+        }
+        break;
+    case INTERLEAVE_GAP:
+        for (i = 0; i < il->nqueues; i++) {
+            PacketQueue *other = &il->queues[i];
+            if (!other->head && !other->gap) {
+                double t = packet_time(&q->head->pkt, q->time_base);
+                av_log(NULL, AV_LOG_WARNING, "Stream %u has no packets, not waiting for it from %.3f\n", i, t);
+                char_buffer_printf(&il->writer->entries, "# gap in stream %u from %.3f\n", i, t);
+                other->gap = 1;
             }
         }
+        ret = interleaver_drain(il, 0);
+        break;
     }
+    return ret;
+}
 
-    oc = avformat_alloc_context();
-    if (!oc) {
-        av_log(NULL, AV_LOG_ERROR, "Could not allocated output context\n");
-        err = 1;
-        goto out;
+/*
+ * Queues a packet, taking ownership of it, and writes out what can be
+ * written.  Returns what the last av_write_frame() call returned.
+ */
+static int interleaver_write(Interleaver *il, AVPacket *pkt)
+{
+    PacketQueue *q = &il->queues[pkt->stream_index];
+    PacketListEntry *entry = xmalloc(sizeof(*entry));
+    int ret;
+
+    entry->pkt = *pkt;
+    entry->next = NULL;
+    pkt->destruct = NULL;
+    pkt->data = NULL;
+    pkt->size = 0;
+    if (q->tail)
+        q->tail->next = entry;
+    else
+        q->head = entry;
+    q->tail = entry;
+    q->bytes += entry->pkt.size;
+    q->gap = 0;
+    il->bytes += entry->pkt.size;
+    if (il->bytes > il->peak_bytes)
+        il->peak_bytes = il->bytes;
+
+    ret = interleaver_drain(il, 0);
+    if (ret <= 0 && interleaver_over_cap(il, q))
+        ret = interleaver_enforce_cap(il, q);
+    return ret;
+}
+
+static void interleaver_free(Interleaver *il)
+{
+    unsigned int i;
+
+    if (!il->queues)
+        return;
+    for (i = 0; i < il->nqueues; i++) {
+        PacketQueue *q = &il->queues[i];
+        while (q->head) {
+            AVPacket pkt;
+            av_free_packet(interleaver_pop(il, q, &pkt));
+        }
     }
-    oc->oformat = output_format;
+    free(il->queues);
+    il->queues = NULL;
+}
 
-    video_index = -1;
-    audio_index = -1;
+typedef struct SegmenterConfig {
+    const char *input_format_str;
+    const char *output_format_str;
+    CharPtrArray bs_filter_names;
+    double segment_duration;
+    const char *http_prefix;
+    int use_mmap;
+    double follow_timeout;
+    int manifest;
+    int with_sha256;
+    int audio_only;
+    int ts_passthrough;
+    size_t queue_max_bytes;
+    double queue_max_duration;
+    enum InterleavePolicy queue_policy;
+} SegmenterConfig;
+
+#ifdef USE_THREADS
+#define CUT_CLOCK_TOLERANCE 0.001
+#define CUT_CLOCK_STALL_SEGMENTS 2 /* segment durations waited for a stalled rendition */
 
-    for (i = 0; i < ic->nb_streams && (video_index < 0 || audio_index < 0); i++) {
-        switch (ic->streams[i]->codec->codec_type) {
-            case CODEC_TYPE_VIDEO:
-                video_index = i;
-                ic->streams[i]->discard = AVDISCARD_NONE;
-                if (!(video_st = add_output_stream(oc, ic->streams[i]))) {
-                    err = 1;
-                    goto out;
-                }
-                break;
-            case CODEC_TYPE_AUDIO:
-                audio_index = i;
-                ic->streams[i]->discard = AVDISCARD_NONE;
-                if (!(audio_st = add_output_stream(oc, ic->streams[i]))) {
-                    err = 1;
-                    goto out;
-                }
-                break;
-            default:
-                ic->streams[i]->discard = AVDISCARD_ALL;
-                break;
+/*
+ * Cut clock shared by renditions segmented in lockstep.  Each rendition
+ * proposes the time of the first keyframe at which it would cut on its own;
+ * once every rendition still running has proposed, the latest proposal
+ * becomes the cut time of that round and each rendition cuts at its first
+ * keyframe at or after it.  Renditions encoded with aligned GOPs therefore
+ * all cut at the same keyframe PTS.  A rendition that has not proposed
+ * within CUT_CLOCK_STALL_SEGMENTS segment durations of wall clock time is
+ * left out of the rounds until it reaches the clock again, so that one
+ * stalled input does not hold up the others.
+ */
+typedef struct CutClock {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned int nactive;
+    unsigned int nproposals;
+    unsigned int round;
+    double proposed_time;
+    double cut_time;
+} CutClock;
+
+static void cut_clock_init(CutClock *clock, unsigned int nrenditions)
+{
+    pthread_mutex_init(&clock->lock, NULL);
+    pthread_cond_init(&clock->cond, NULL);
+    clock->nactive = nrenditions;
+    clock->nproposals = 0;
+    clock->round = 0;
+    clock->proposed_time = 0.;
+    clock->cut_time = 0.;
+}
+
+static void cut_clock_destroy(CutClock *clock)
+{
+    pthread_cond_destroy(&clock->cond);
+    pthread_mutex_destroy(&clock->lock);
+}
+
+static void cut_clock_decide(CutClock *clock)
+{
+    clock->cut_time = clock->proposed_time;
+    clock->nproposals = 0;
+    clock->round++;
+    pthread_cond_broadcast(&clock->cond);
+}
+
+static void cut_clock_wait(CutClock *clock, unsigned int round, double timeout)
+{
+    struct timespec deadline;
+    double t = get_wallclock() + timeout;
+
+    deadline.tv_sec = t;
+    deadline.tv_nsec = (t - deadline.tv_sec) * 1e9;
+    while (clock->round == round) {
+        if (pthread_cond_timedwait(&clock->cond, &clock->lock, &deadline) == ETIMEDOUT && clock->round == round) {
+            av_log(NULL, AV_LOG_WARNING, "%u rendition(s) stalled, cutting without them\n", clock->nactive - clock->nproposals);
+            clock->nactive = clock->nproposals;
+            cut_clock_decide(clock);
+        }
+    }
+}
+
+/*
+ * Returns non-zero if the rendition that has made *round cuts so far should
+ * cut at a keyframe of frame_time.  On a cut, *round is advanced to the
+ * agreed round and *last_cut_time is set to frame_time.  *synced_round is
+ * the round up to which the rendition has taken part; it is behind when
+ * the rendition was left out of a round.
+ */
+static int cut_clock_should_cut(CutClock *clock, unsigned int *round, unsigned int *synced_round, double *last_cut_time, double frame_time, double segment_duration)
+{
+    int retval = 0;
+
+    pthread_mutex_lock(&clock->lock);
+    if (*synced_round < clock->round) {
+        /* back from a stall, take part in the rounds again */
+        clock->nactive++;
+        *synced_round = clock->round;
+    }
+    if (*round < clock->round) {
+        /* the others have agreed on a cut this rendition has not made yet */
+        retval = frame_time >= clock->cut_time - CUT_CLOCK_TOLERANCE;
+    } else if (frame_time - *last_cut_time >= segment_duration) {
+        if (clock->nproposals == 0 || frame_time > clock->proposed_time)
+            clock->proposed_time = frame_time;
+        if (++clock->nproposals >= clock->nactive)
+            cut_clock_decide(clock);
+        else
+            cut_clock_wait(clock, *round, CUT_CLOCK_STALL_SEGMENTS * segment_duration);
+        *synced_round = clock->round;
+        retval = frame_time >= clock->cut_time - CUT_CLOCK_TOLERANCE;
+    }
+    if (retval) {
+        /* a rendition back from a stall skips the rounds it missed */
+        *round = clock->round;
+        /* segment durations are measured from the keyframe actually cut on */
+        *last_cut_time = frame_time;
+    }
+    pthread_mutex_unlock(&clock->lock);
+    return retval;
+}
+
+static void cut_clock_finish(CutClock *clock, unsigned int synced_round)
+{
+    pthread_mutex_lock(&clock->lock);
+    /* a rendition left out of the last round is not counted any more */
+    if (synced_round >= clock->round)
+        clock->nactive--;
+    if (clock->nproposals > 0 && clock->nproposals >= clock->nactive)
+        cut_clock_decide(clock);
+    pthread_mutex_unlock(&clock->lock);
+}
+
+#ifdef HAVE_AV_LOCKMGR_REGISTER
+static int lock_manager(void **mutex, enum AVLockOp op)
+{
+    switch (op) {
+    case AV_LOCK_CREATE:
+        *mutex = xmalloc(sizeof(pthread_mutex_t));
+        return pthread_mutex_init(*mutex, NULL) != 0;
+    case AV_LOCK_OBTAIN:
+        return pthread_mutex_lock(*mutex) != 0;
+    case AV_LOCK_RELEASE:
+        return pthread_mutex_unlock(*mutex) != 0;
+    case AV_LOCK_DESTROY:
+        pthread_mutex_destroy(*mutex);
+        free(*mutex);
+        *mutex = NULL;
+        return 0;
+    }
+    return 1;
+}
+#endif /* HAVE_AV_LOCKMGR_REGISTER */
+#endif /* USE_THREADS */
+
+typedef struct Segmenter {
+    const SegmenterConfig *config;
+    const char *input;
+    const char *input_ext;
+    char *output_prefix;
+    char *index_file;
+    char output_ext[1024];
+    AVFormatContext *ic;
+    AVFormatContext *oc;
+    AVStream *video_st;
+    AVStream *audio_st;
+    int video_index;
+    int audio_index;
+    AVBitStreamFilterContext **bs_filters;
+    Interleaver interleaver;
+    AVIOContext *input_pb;
+    AudioFrameReader audio_reader;
+    TsReader ts_reader;
+    IndexFileWriter writer;
+    SegmentOutput output;
+    int started;
+    double last_frame_time;
+    unsigned int peak_bandwidth;
+#ifdef USE_MMAP_READER
+    MmapReader mmap_reader;
+#endif /* USE_MMAP_READER */
+#ifdef USE_THREADS
+    CutClock *clock;
+    unsigned int round;
+    unsigned int synced_round;
+    struct MasterPlaylistWriter *master;
+    pthread_t thread;
+    int thread_started;
+#endif /* USE_THREADS */
+    int err;
+} Segmenter;
+
+static int segmenter_init(Segmenter *seg, const SegmenterConfig *config, const char *input, const char *output_prefix, const char *index_file)
+{
+    seg->config = config;
+    seg->input = input;
+    seg->input_ext = NULL;
+    seg->output_prefix = output_prefix ? xstrdup(output_prefix): NULL;
+    seg->index_file = NULL;
+    strcpy(seg->output_ext, "ts");
+    seg->ic = NULL;
+    seg->oc = NULL;
+    seg->video_st = NULL;
+    seg->audio_st = NULL;
+    seg->video_index = -1;
+    seg->audio_index = -1;
+    seg->bs_filters = NULL;
+    seg->interleaver.queues = NULL;
+    seg->input_pb = NULL;
+    seg->audio_reader.buf = NULL;
+    seg->ts_reader.buf = NULL;
+    seg->output.fd = -1;
+    seg->output.pb = NULL;
+    seg->output.sha = NULL;
+    seg->started = 0;
+    seg->last_frame_time = 0.;
+    seg->peak_bandwidth = 0;
+#ifdef USE_MMAP_READER
+    seg->mmap_reader.fd = -1;
+    seg->mmap_reader.pb = NULL;
+    seg->mmap_reader.map = NULL;
+#endif /* USE_MMAP_READER */
+#ifdef USE_THREADS
+    seg->clock = NULL;
+    seg->round = 0;
+    seg->synced_round = 0;
+    seg->master = NULL;
+    seg->thread_started = 0;
+#endif /* USE_THREADS */
+    seg->err = 0;
+
+    if (!strcmp(input, "-")) {
+        seg->input = "pipe:";
+        if (!seg->output_prefix) {
+            av_log(NULL, AV_LOG_ERROR, "Please specify output prefix\n");
+            return 1;
+        }
+    } else {
+        const char *input_basename = basename((char *)input);
+        const char *p = strchr(input_basename, '.');
+        if (!p) {
+            if (!seg->output_prefix)
+                seg->output_prefix = xstrdup(input_basename);
+        } else {
+            seg->input_ext = p + 1;
+            if (!seg->output_prefix) {
+                size_t len = p - input_basename;
+                seg->output_prefix = xmalloc(len + 1);
+                memmove(seg->output_prefix, input_basename, len);
+                seg->output_prefix[len] = '\0';
+            }
+        }
+    }
+
+    if (index_file) {
+        seg->index_file = xstrdup(index_file);
+    } else {
+        /* rendition of a ladder: <output prefix>.m3u8 */
+        size_t len = strlen(seg->output_prefix);
+        seg->index_file = xmalloc(len + sizeof(".m3u8"));
+        memmove(seg->index_file, seg->output_prefix, len);
+        memmove(seg->index_file + len, ".m3u8", sizeof(".m3u8"));
+    }
+
+    return index_file_writer_init(&seg->writer, seg->index_file, config->segment_duration, seg->output_prefix, seg->output_ext, config->http_prefix, 1);
+}
+
+static int segmenter_open(Segmenter *seg)
+{
+    const SegmenterConfig *config = seg->config;
+    AVInputFormat *input_format = NULL;
+    AVOutputFormat *output_format = NULL;
+    AVFormatContext *ic, *oc;
+    int ret;
+    int i;
+
+    if (config->input_format_str) {
+        input_format = av_find_input_format(config->input_format_str);
+        if (!input_format) {
+            av_log(NULL, AV_LOG_ERROR, "Specified input file format is not supported.\n");
+            return 1;
+        }
+    } else {
+        input_format = guess_input_format_from_filename(seg->input);
+        if (!input_format) {
+            av_log(NULL, AV_LOG_INFO, "Could not determine input file format. MPEG-TS assumed\n");
+            input_format = av_find_input_format("mpegts");
+            if (!input_format) {
+                av_log(NULL, AV_LOG_ERROR, "Could not find MPEG-TS demuxer\n");
+                return 1;
+            }
+        }
+    }
+
+    if (config->use_mmap && strcmp(seg->input, "pipe:")) {
+#ifdef USE_MMAP_READER
+        if (!mmap_reader_open(&seg->mmap_reader, seg->input, config->follow_timeout)) {
+            av_log(NULL, AV_LOG_VERBOSE, "Using memory-mapped input reader\n");
+        }
+#else
+        av_log(NULL, AV_LOG_WARNING, "Memory-mapped input is not supported on this platform\n");
+#endif /* USE_MMAP_READER */
+    }
+
+#ifdef USE_MMAP_READER
+    if (seg->mmap_reader.pb) {
+#ifdef HAVE_AVFORMAT_OPEN_INPUT
+        seg->ic = avformat_alloc_context();
+        if (!seg->ic) {
+            av_log(NULL, AV_LOG_ERROR, "Could not allocated input context\n");
+            return 1;
+        }
+        seg->ic->pb = seg->mmap_reader.pb;
+        ret = avformat_open_input(&seg->ic, seg->input, input_format, NULL);
+#else
+        ret = av_open_input_stream(&seg->ic, seg->mmap_reader.pb, seg->input, input_format, NULL);
+#endif /* HAVE_AVFORMAT_OPEN_INPUT */
+    } else
+#endif /* USE_MMAP_READER */
+    {
+#ifdef HAVE_AVFORMAT_OPEN_INPUT
+        ret = avformat_open_input(&seg->ic, seg->input, input_format, NULL);
+#else
+        ret = av_open_input_file(&seg->ic, seg->input, input_format, 0, NULL);
+#endif /* HAVE_AVFORMAT_OPEN_INPUT */
+    }
+    if (ret != 0) {
+        char buf[1024];
+#ifdef HAVE_AV_STRERROR
+        av_strerror(ret, buf, sizeof(buf));
+#else
+        snprintf(buf, sizeof(buf), "%d", ret);
+#endif /* HAVE_AV_STRERROR */
+
+        av_log(NULL, AV_LOG_ERROR, "Could not open input file, make sure it is %s file: %s\n", input_format->long_name, buf);
+        return 1;
+    }
+    ic = seg->ic;
+
+#ifdef HAVE_AVFORMAT_FIND_STREAM_INFO
+    if (avformat_find_stream_info(ic, NULL) < 0)
+#else
+    if (av_find_stream_info(ic) < 0)
+#endif /* HAVE_AVFORMAT_FIND_STREAM_INFO */
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not read stream information\n");
+        return 1;
+    }
+
+    output_format = av_guess_format(config->output_format_str, NULL, NULL);
+    if (!output_format) {
+        av_log(NULL, AV_LOG_ERROR, "Could not find MPEG-TS muxer\n");
+        return 1;
+    }
+    if (output_format->extensions) {
+        const char *extensions = output_format->extensions, *p;
+        const char *end = extensions + strlen(extensions);
+        const char *sep;
+        for (p = extensions; p; p = sep == end ? NULL: sep + 1) {
+            sep = strchr(p, ',');
+            if (!sep)
+                sep = end;
+            assert(sep - p > 0);
+            /* Use the same extension as the input file if possible */
+            if (seg->input_ext && (strncmp(p, seg->input_ext, sep - p) == 0 || p == extensions)) {
+                strncpy(seg->output_ext, p, sep - p);
+                seg->output_ext[sep - p] = '\0';
+            }
+        }
+    }
+
+    oc = seg->oc = avformat_alloc_context();
+    if (!oc) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocated output context\n");
+        return 1;
+    }
+    oc->oformat = output_format;
+
+    for (i = 0; i < ic->nb_streams && (seg->video_index < 0 || seg->audio_index < 0); i++) {
+        switch (ic->streams[i]->codec->codec_type) {
+            case CODEC_TYPE_VIDEO:
+                seg->video_index = i;
+                ic->streams[i]->discard = AVDISCARD_NONE;
+                if (!(seg->video_st = add_output_stream(oc, ic->streams[i])))
+                    return 1;
+                break;
+            case CODEC_TYPE_AUDIO:
+                seg->audio_index = i;
+                ic->streams[i]->discard = AVDISCARD_NONE;
+                if (!(seg->audio_st = add_output_stream(oc, ic->streams[i])))
+                    return 1;
+                break;
+            default:
+                ic->streams[i]->discard = AVDISCARD_ALL;
+                break;
+        }
+    }
+
+    seg->bs_filters = xcalloc(oc->nb_streams, sizeof(*seg->bs_filters));
+
+    for (i = 0; i < oc->nb_streams; i++) {
+        const char **p = config->bs_filter_names.elems;
+        const char **e = config->bs_filter_names.elems + config->bs_filter_names.nelems;
+        AVBitStreamFilterContext *bs_filter = NULL;
+        for (; p < e; p++) {
+            AVBitStreamFilterContext *new_bs_filter = av_bitstream_filter_init(*p);
+            if (!new_bs_filter) {
+                av_log(NULL, AV_LOG_ERROR, "Unknown bitstream filter: %s\n", *p);
+                return 1;
+            }
+            if (bs_filter)
+                bs_filter->next = new_bs_filter;
+            bs_filter = new_bs_filter;
+            p++;
+        }
+        seg->bs_filters[i] = bs_filter;
+    }
+
+
+#if 0
+    if (av_set_parameters(oc, NULL) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Invalid output format parameters\n");
+        return 1;
+    }
+#endif
+
+    av_dump_format(oc, 0, seg->output_prefix, 1);
+
+	if (seg->video_st) {
+        AVCodec *codec = avcodec_find_decoder(seg->video_st->codec->codec_id);
+        if (!codec) {
+            av_log(NULL, AV_LOG_ERROR, "Could not find video decoder, key frames will not be honored\n");
+        }
+
+#ifdef HAVE_AVCODEC_OPEN2
+        if (avcodec_open2(seg->video_st->codec, codec, NULL) < 0)
+#else
+        if (avcodec_open(seg->video_st->codec, codec) < 0)
+#endif
+        {
+            av_log(NULL, AV_LOG_ERROR, "Could not open video decoder, key frames will not be honored\n");
+        }
+    }
+
+    if (seg->audio_st) {
+        AVCodec *codec = avcodec_find_decoder(seg->audio_st->codec->codec_id);
+        if (!codec) {
+            av_log(NULL, AV_LOG_ERROR, "Could not find video decoder, key frames will not be honored\n");
+        }
+
+#ifdef HAVE_AVCODEC_OPEN2
+        if (avcodec_open2(seg->audio_st->codec, codec, NULL) < 0)
+#else
+        if (avcodec_open(seg->audio_st->codec, codec) < 0)
+#endif
+        {
+            av_log(NULL, AV_LOG_ERROR, "Could not open video decoder, key frames will not be honored\n");
+        }
+    }
+
+    if (config->manifest && index_file_writer_open_manifest(&seg->writer, config->with_sha256))
+        return 1;
+
+    if (index_file_writer_begin(&seg->writer))
+        return 1;
+
+    if (segment_output_open(&seg->output, seg->writer.current_ts_file, config->with_sha256))
+        return 1;
+    oc->pb = seg->output.pb;
+
+#ifdef HAVE_AVFORMAT_WRITE_HEADER
+    if (avformat_write_header(oc, NULL))
+#else
+    if (av_write_header(oc))
+#endif
+    {
+        av_log(NULL, AV_LOG_ERROR, "Could not write mpegts header to first output file\n");
+        return 1;
+    }
+
+    /* the muxer may pick its own time bases when writing the header */
+    interleaver_init(&seg->interleaver, oc, &seg->writer, config->queue_max_bytes, config->queue_max_duration, config->queue_policy);
+
+    return 0;
+}
+
+#ifdef USE_THREADS
+typedef struct MasterPlaylistWriter {
+    const char *master_file;
+    char *tmp_file;
+    const char *http_prefix;
+    Segmenter *renditions;
+    size_t nrenditions;
+    pthread_mutex_t lock;
+} MasterPlaylistWriter;
+
+static void master_playlist_writer_init(MasterPlaylistWriter *writer, const char *master_file, const char *http_prefix, Segmenter *renditions, size_t nrenditions)
+{
+    writer->master_file = master_file;
+    writer->tmp_file = make_tmp_file_name(master_file);
+    writer->http_prefix = http_prefix;
+    writer->renditions = renditions;
+    writer->nrenditions = nrenditions;
+    pthread_mutex_init(&writer->lock, NULL);
+}
+
+static void master_playlist_writer_free(MasterPlaylistWriter *writer)
+{
+    pthread_mutex_destroy(&writer->lock);
+    free(writer->tmp_file);
+}
+
+/*
+ * Rewrites the master playlist with the peak bandwidth measured so far for
+ * each rendition.  Unless final is set, nothing is written until every
+ * rendition has completed at least one segment.  Called with the lock held.
+ */
+static int master_playlist_writer_listed(const Segmenter *seg, int final)
+{
+    /* once segmenting is over, renditions that failed or wrote no segment are left out */
+    return !final || (!seg->err && seg->peak_bandwidth);
+}
+
+static int master_playlist_writer_write_locked(MasterPlaylistWriter *writer, int final)
+{
+    FILE *fp;
+    size_t i, nlisted = 0;
+
+    for (i = 0; i < writer->nrenditions; i++) {
+        if (!final && !writer->renditions[i].peak_bandwidth)
+            return 0;
+        if (master_playlist_writer_listed(&writer->renditions[i], final))
+            nlisted++;
+    }
+    if (!nlisted) {
+        av_log(NULL, AV_LOG_ERROR, "No rendition was segmented, not writing master m3u8 file\n");
+        return 1;
+    }
+
+    fp = fopen(writer->tmp_file, "w");
+    if (!fp) {
+        av_log(NULL, AV_LOG_ERROR, "Could not open temporary master m3u8 file (%s)\n", writer->tmp_file);
+        return 1;
+    }
+    if (fprintf(fp, "#EXTM3U\n") < 0)
+        goto err;
+    for (i = 0; i < writer->nrenditions; i++) {
+        const Segmenter *seg = &writer->renditions[i];
+        if (!master_playlist_writer_listed(seg, final))
+            continue;
+        if (fprintf(fp, "#EXT-X-STREAM-INF:BANDWIDTH=%u", seg->peak_bandwidth) < 0)
+            goto err;
+        if (seg->video_st && seg->video_st->codec->width > 0) {
+            if (fprintf(fp, ",RESOLUTION=%dx%d", seg->video_st->codec->width, seg->video_st->codec->height) < 0)
+                goto err;
+        }
+        if (fprintf(fp, "\n%s%s\n", writer->http_prefix, seg->index_file) < 0)
+            goto err;
+    }
+    fclose(fp);
+    rename(writer->tmp_file, writer->master_file);
+    SEGMENTER_PROBE2(playlist_publish, writer->master_file, nlisted);
+    return 0;
+err:
+    av_log(NULL, AV_LOG_ERROR, "Could not write to master m3u8 file\n");
+    fclose(fp);
+    return 1;
+}
+
+static int master_playlist_writer_write(MasterPlaylistWriter *writer)
+{
+    int retval;
+    pthread_mutex_lock(&writer->lock);
+    retval = master_playlist_writer_write_locked(writer, 1);
+    pthread_mutex_unlock(&writer->lock);
+    return retval;
+}
+
+static int master_playlist_writer_update_bandwidth(MasterPlaylistWriter *writer, Segmenter *seg, unsigned int bandwidth)
+{
+    int retval = 0;
+    pthread_mutex_lock(&writer->lock);
+    if (bandwidth > seg->peak_bandwidth) {
+        seg->peak_bandwidth = bandwidth;
+        retval = master_playlist_writer_write_locked(writer, 0);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return retval;
+}
+#endif /* USE_THREADS */
+
+static int segmenter_should_cut(Segmenter *seg, double frame_time)
+{
+#ifdef USE_THREADS
+    if (seg->clock)
+        return cut_clock_should_cut(seg->clock, &seg->round, &seg->synced_round, &seg->last_frame_time, frame_time, seg->config->segment_duration);
+#endif /* USE_THREADS */
+    if (frame_time - seg->last_frame_time >= seg->config->segment_duration) {
+        seg->last_frame_time = frame_time;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Accounts the bitrate of a completed segment in the peak bandwidth of the
+ * rendition, and republishes the master playlist when it has grown.
+ */
+static void segmenter_update_bandwidth(Segmenter *seg, unsigned int bandwidth)
+{
+#ifdef USE_THREADS
+    if (seg->master) {
+        master_playlist_writer_update_bandwidth(seg->master, seg, bandwidth);
+        return;
+    }
+#endif /* USE_THREADS */
+    if (bandwidth > seg->peak_bandwidth)
+        seg->peak_bandwidth = bandwidth;
+}
+
+#define SEGMENT_MIN_BITRATE_DURATION 0.1 /* a few frames; shorter segments get no bitrate */
+
+/*
+ * Closes the current segment and adds it to the index file with its
+ * measured duration, size, bitrate and checksums.
+ */
+static int segmenter_finish_segment(Segmenter *seg, double duration)
+{
+    SegmentInfo info;
+    int retval;
+
+    retval = segment_output_close(&seg->output, &info);
+    if (seg->oc)
+        seg->oc->pb = NULL;
+    if (retval)
+        av_log(NULL, AV_LOG_ERROR, "Could not finish writing '%s'\n", seg->writer.current_ts_file);
+
+    info.duration = duration;
+    info.bitrate = 0;
+    if (duration >= SEGMENT_MIN_BITRATE_DURATION) {
+        /* too short a segment would give a meaningless peak */
+        double bitrate = info.size * 8 / duration;
+        info.bitrate = bitrate < UINT_MAX ? bitrate: UINT_MAX;
+    }
+    if (info.bitrate > 0)
+        segmenter_update_bandwidth(seg, info.bitrate);
+
+    return index_file_writer_write_index(&seg->writer, &info) || retval;
+}
+
+static int segmenter_run(Segmenter *seg)
+{
+    const SegmenterConfig *config = seg->config;
+    AVFormatContext *ic = seg->ic;
+    AVFormatContext *oc = seg->oc;
+    AVStream *video_st = seg->video_st;
+    AVStream *audio_st = seg->audio_st;
+    double frame_time = 0., video_frame_time = 0., audio_frame_time = 0.;
+    int video_seen = 0, audio_seen = 0;
+    int ret;
+
+    {
+        AVPacket packet;
+
+        for (;;) {
+            AVStream *st;
+            SEGMENTER_PROBE0(read_begin);
+            ret = av_read_frame(ic, &packet);
+            if (ret == AVERROR(EAGAIN))
+                continue;
+
+            if (ret == AVERROR_EOF)
+                break;
+            else if (ret < 0) {
+                char buf[1024];
+                av_strerror(ret, buf, sizeof(buf));
+                av_log(NULL, AV_LOG_WARNING, "Warning: %s (reached EOF?)\n", buf);
+                break;
+            }
+
+            if (av_dup_packet(&packet) < 0) {
+                av_log(NULL, AV_LOG_ERROR, "Could not duplicate packet\n");
+                av_free_packet(&packet);
+                break;
+            }
+
+            if (packet.stream_index != seg->video_index && packet.stream_index != seg->audio_index) {
+                /* streams past the first video and audio ones are not discarded by the demuxer */
+                SEGMENTER_PROBE3(read_end, -1, AV_NOPTS_VALUE, packet.size);
+                av_free_packet(&packet);
+                continue;
+            }
+
+            if (packet.stream_index == seg->video_index) {
+                video_frame_time = (double)packet.pts * video_st->codec->time_base.num / video_st->codec->time_base.den;
+                video_seen = 1;
+                st = video_st;
+            } else {
+                audio_frame_time = (double)packet.pts * audio_st->codec->time_base.num / audio_st->codec->time_base.den;
+                audio_seen = 1;
+                st = audio_st;
+            }
+            packet.stream_index = st->index;
+            packet.pts = packet.pts * st->codec->time_base.num * st->time_base.den / st->codec->time_base.den * st->time_base.num;
+            packet.dts = packet.dts * st->codec->time_base.num * st->time_base.den / st->codec->time_base.den * st->time_base.num;
+            SEGMENTER_PROBE3(read_end, packet.stream_index, packet.pts, packet.size);
+
+            av_log(NULL, AV_LOG_INFO, "video frame time=%f, audio frame time=%f\n", video_frame_time, audio_frame_time);
+            if (video_st) {
+                if (audio_st) {
+                    frame_time = video_frame_time < audio_frame_time ? video_frame_time: audio_frame_time;
+                } else {
+                    frame_time = video_frame_time;
+                }
+            } else {
+                assert(audio_st != NULL);
+                frame_time = audio_frame_time;
+            }
+
+            if (!seg->started && (!video_st || video_seen) && (!audio_st || audio_seen)) {
+                /* segment durations are measured from the start of the stream */
+                seg->last_frame_time = frame_time;
+                seg->started = 1;
+            }
+
+            {
+                AVBitStreamFilterContext *bsfc = seg->bs_filters[st->index];
+                SEGMENTER_PROBE3(filter_begin, packet.stream_index, packet.pts, packet.size);
+                for (; bsfc; bsfc = bsfc->next) {
+                    AVPacket filtered = packet;
+                    ret = av_bitstream_filter_filter(bsfc, st->codec, NULL,
+                            &filtered.data, &filtered.size,
+                            packet.data, packet.size,
+                            packet.flags & AV_PKT_FLAG_KEY);
+                    if (ret < 0) {
+                        av_log(NULL, AV_LOG_ERROR, "Failed to apply bitstream filters\n");
+                        av_free_packet(&packet);
+                        return 1;
+                    }
+                    if (ret > 0) {
+                        av_free_packet(&packet);
+                        filtered.destruct = av_destruct_packet;
+                        packet = filtered;
+                    }
+                }
+                SEGMENTER_PROBE3(filter_end, packet.stream_index, packet.pts, packet.size);
+            }
+
+            /*
+             * demuxers flag every audio packet as a keyframe, so with video
+             * only its keyframes start a segment, at their own PTS
+             */
+            if (seg->started && (packet.flags & PKT_FLAG_KEY) && (!video_st || st == video_st)) {
+                double last_frame_time = seg->last_frame_time;
+                double cut_time = video_st ? video_frame_time: frame_time;
+                if (segmenter_should_cut(seg, cut_time)) {
+                    SEGMENTER_PROBE2(cut_begin, seg->writer.sequence_num, (int64_t)(cut_time * 1000));
+                    av_log(NULL, AV_LOG_DEBUG, "Flushing\n");
+                    av_log(NULL, AV_LOG_VERBOSE, "Interleave queues: %zd bytes (peak %zd bytes)\n", seg->interleaver.bytes, seg->interleaver.peak_bytes);
+                    /* everything before the keyframe belongs to the segment being closed */
+                    interleaver_drain(&seg->interleaver, 1);
+                    segmenter_finish_segment(seg, seg->last_frame_time - last_frame_time);
+
+                    if (segment_output_open(&seg->output, seg->writer.current_ts_file, config->with_sha256)) {
+                        av_free_packet(&packet);
+                        break;
+                    }
+                    oc->pb = seg->output.pb;
+                    SEGMENTER_PROBE1(cut_end, seg->writer.sequence_num);
+                }
+            }
+
+            ret = interleaver_write(&seg->interleaver, &packet);
+            if (ret > 0) {
+                av_log(NULL, AV_LOG_ERROR, "End of stream requested\n");
+                break;
+            }
+        }
+    }
+
+#ifdef USE_THREADS
+    /* this rendition no longer takes part in cut decisions */
+    if (seg->clock) {
+        cut_clock_finish(seg->clock, seg->synced_round);
+        seg->clock = NULL;
+    }
+#endif /* USE_THREADS */
+
+    if (!oc->pb)
+        return 1;
+
+    interleaver_drain(&seg->interleaver, 1);
+    av_log(NULL, AV_LOG_INFO, "Interleave queues peaked at %zd bytes", seg->interleaver.peak_bytes);
+    if (seg->interleaver.dropped > 0)
+        av_log(NULL, AV_LOG_INFO, ", %"PRId64" packets dropped", seg->interleaver.dropped);
+    av_log(NULL, AV_LOG_INFO, "\n");
+
+    av_write_trailer(oc);
+
+    {
+        double duration;
+        if (ic->duration != AV_NOPTS_VALUE)
+            duration = ((double)(ic->start_time != AV_NOPTS_VALUE ? ic->start_time: 0) + ic->duration) / AV_TIME_BASE - seg->last_frame_time;
+        else
+            duration = frame_time - seg->last_frame_time;
+        segmenter_finish_segment(seg, duration);
+    }
+
+    index_file_writer_finalize(&seg->writer);
+
+    return 0;
+}
+
+/*
+ * Opens the input as a plain byte stream for the engines that do not go
+ * through a demuxer.
+ */
+static AVIOContext *segmenter_open_byte_input(Segmenter *seg)
+{
+    const SegmenterConfig *config = seg->config;
+    AVIOContext *pb = NULL;
+
+    if (config->use_mmap && strcmp(seg->input, "pipe:")) {
+#ifdef USE_MMAP_READER
+        if (!mmap_reader_open(&seg->mmap_reader, seg->input, config->follow_timeout))
+            pb = seg->mmap_reader.pb;
+#else
+        av_log(NULL, AV_LOG_WARNING, "Memory-mapped input is not supported on this platform\n");
+#endif /* USE_MMAP_READER */
+    }
+
+    if (!pb) {
+#ifdef HAVE_AVIO_OPEN
+        if (avio_open(&seg->input_pb, seg->input, URL_RDONLY) < 0)
+#else
+        if (url_fopen(&seg->input_pb, seg->input, URL_RDONLY) < 0)
+#endif
+        {
+            av_log(NULL, AV_LOG_ERROR, "Could not open '%s'\n", seg->input);
+            return NULL;
+        }
+        pb = seg->input_pb;
+    }
+
+    return pb;
+}
+
+static int segmenter_open_audio(Segmenter *seg)
+{
+    AVIOContext *pb = segmenter_open_byte_input(seg);
+    if (!pb)
+        return 1;
+    audio_frame_reader_init(&seg->audio_reader, pb);
+    return 0;
+}
+
+/*
+ * Writes the ID3 tag that carries the timestamp of the first sample of a
+ * packed audio segment, as an MPEG-2 90kHz PTS.
+ */
+static void write_audio_timestamp_tag(AVIOContext *pb, double frame_time)
+{
+    static const char owner[] = "com.apple.streaming.transportStreamTimestamp";
+    uint64_t pts = (uint64_t)(frame_time * 90000 + 0.5) & ((1ULL << 33) - 1);
+    uint8_t tag[10 + 10 + sizeof(owner) + 8];
+    size_t frame_size = sizeof(owner) + 8;
+    int i;
+
+    memcpy(tag, "ID3\x04\x00\x00", 6);
+    tag[6] = 0;
+    tag[7] = 0;
+    tag[8] = 0;
+    tag[9] = sizeof(tag) - 10;
+    memcpy(tag + 10, "PRIV", 4);
+    tag[14] = 0;
+    tag[15] = 0;
+    tag[16] = 0;
+    tag[17] = frame_size;
+    tag[18] = 0;
+    tag[19] = 0;
+    memcpy(tag + 20, owner, sizeof(owner));
+    for (i = 0; i < 8; i++)
+        tag[20 + sizeof(owner) + i] = pts >> (56 - i * 8);
+    avio_write(pb, tag, sizeof(tag));
+}
+
+/*
+ * Fast path for audio-only MP3 and ADTS inputs: frames are parsed from
+ * their headers and copied verbatim into raw (packed audio) segments, cut
+ * on frame boundaries.  Timestamps come from the sample count.
+ */
+static int segmenter_run_audio(Segmenter *seg)
+{
+    const SegmenterConfig *config = seg->config;
+    AudioFrameHeader hdr;
+    const uint8_t *data;
+    int64_t samples = 0;
+    int sample_rate = 0;
+    double base_time = 0., frame_time = 0.;
+
+    for (;;) {
+        SEGMENTER_PROBE0(read_begin);
+        if (audio_frame_reader_next(&seg->audio_reader, &hdr, &data))
+            break;
+        if (hdr.sample_rate != sample_rate) {
+            if (sample_rate)
+                base_time += (double)samples / sample_rate;
+            samples = 0;
+            sample_rate = hdr.sample_rate;
+        }
+        frame_time = base_time + (double)samples / sample_rate;
+        SEGMENTER_PROBE3(read_end, 0, (int64_t)(frame_time * 90000), hdr.size);
+
+        if (!seg->output.pb) {
+            if (seg->started)
+                return 1;
+            strcpy(seg->output_ext, hdr.format == AUDIO_FORMAT_ADTS ? "aac": "mp3");
+            if (config->manifest && index_file_writer_open_manifest(&seg->writer, config->with_sha256))
+                return 1;
+            if (index_file_writer_begin(&seg->writer))
+                return 1;
+            if (segment_output_open(&seg->output, seg->writer.current_ts_file, config->with_sha256))
+                return 1;
+            write_audio_timestamp_tag(seg->output.pb, frame_time);
+            seg->last_frame_time = frame_time;
+            seg->started = 1;
+        } else {
+            double last_frame_time = seg->last_frame_time;
+            if (segmenter_should_cut(seg, frame_time)) {
+                SEGMENTER_PROBE2(cut_begin, seg->writer.sequence_num, (int64_t)(frame_time * 1000));
+                segmenter_finish_segment(seg, seg->last_frame_time - last_frame_time);
+                if (segment_output_open(&seg->output, seg->writer.current_ts_file, config->with_sha256))
+                    break;
+                write_audio_timestamp_tag(seg->output.pb, frame_time);
+                SEGMENTER_PROBE1(cut_end, seg->writer.sequence_num);
+            }
+        }
+
+        SEGMENTER_PROBE3(write_begin, 0, (int64_t)(frame_time * 90000), hdr.size);
+        avio_write(seg->output.pb, data, hdr.size);
+        SEGMENTER_PROBE3(write_end, 0, (int64_t)(frame_time * 90000), seg->output.pb->error);
+        samples += hdr.samples;
+    }
+
+#ifdef USE_THREADS
+    if (seg->clock) {
+        cut_clock_finish(seg->clock, seg->synced_round);
+        seg->clock = NULL;
+    }
+#endif /* USE_THREADS */
+
+    if (!seg->started) {
+        av_log(NULL, AV_LOG_ERROR, "No MP3 or ADTS frames found in '%s'\n", seg->input);
+        return 1;
+    }
+    if (!seg->output.pb)
+        return 1;
+
+    segmenter_finish_segment(seg, base_time + (double)samples / sample_rate - seg->last_frame_time);
+    index_file_writer_finalize(&seg->writer);
+
+    return 0;
+}
+
+static int segmenter_open_ts(Segmenter *seg)
+{
+    const SegmenterConfig *config = seg->config;
+    AVIOContext *pb;
+
+    if (strcmp(config->output_format_str, "mpegts")) {
+        av_log(NULL, AV_LOG_ERROR, "TS passthrough requires MPEG-TS output\n");
+        return 1;
+    }
+    pb = segmenter_open_byte_input(seg);
+    if (!pb)
+        return 1;
+    ts_reader_init(&seg->ts_reader, pb);
+    return 0;
+}
+
+/* Starts a new segment with the current PAT and PMT, so that it can be decoded on its own */
+static int segmenter_open_ts_segment(Segmenter *seg)
+{
+    TsReader *reader = &seg->ts_reader;
+    if (segment_output_open(&seg->output, seg->writer.current_ts_file, seg->config->with_sha256))
+        return 1;
+    avio_write(seg->output.pb, reader->pat, TS_PACKET_SIZE);
+    avio_write(seg->output.pb, reader->pmt, TS_PACKET_SIZE);
+    return 0;
+}
+
+/*
+ * Passthrough engine for MPEG-TS to MPEG-TS: packets are never demuxed,
+ * and runs of them are copied verbatim into the segments, so PCR and
+ * continuity counters are preserved.  Segments start at a random access
+ * point of the cut PID, found from the adaptation field's
+ * random_access_indicator or from the start of the elementary stream.
+ */
+static int segmenter_run_ts(Segmenter *seg)
+{
+    const SegmenterConfig *config = seg->config;
+    TsReader *reader = &seg->ts_reader;
+    size_t range_start = 0;
+    double frame_time = 0.;
+    int err = 0;
+
+    if (config->manifest && index_file_writer_open_manifest(&seg->writer, config->with_sha256))
+        return 1;
+    if (index_file_writer_begin(&seg->writer))
+        return 1;
+
+    for (;;) {
+        const uint8_t *p, *payload, *end;
+        int pid, random_access = 0;
+
+        if (reader->len - reader->pos < TS_PACKET_SIZE * TS_RAP_SCAN_PACKETS && !reader->eof) {
+            /* the range to copy must not move under us */
+            if (seg->output.pb && reader->pos > range_start && segment_output_write(&seg->output, reader->buf + range_start, reader->pos - range_start)) {
+                err = 1;
+                break;
+            }
+            SEGMENTER_PROBE0(read_begin);
+            /* keep enough packets ahead to find the picture type at a PES start */
+            ts_reader_fill(reader, TS_PACKET_SIZE * TS_RAP_SCAN_PACKETS);
+            SEGMENTER_PROBE3(read_end, -1, AV_NOPTS_VALUE, reader->last_read);
+            range_start = reader->pos;
+        }
+        if (reader->len - reader->pos < TS_PACKET_SIZE) {
+            if (seg->output.pb && reader->pos > range_start && segment_output_write(&seg->output, reader->buf + range_start, reader->pos - range_start))
+                err = 1;
+            break;
+        }
+
+        p = reader->buf + reader->pos;
+        if (p[0] != TS_SYNC_BYTE) {
+            size_t skip;
+            if (seg->output.pb && reader->pos > range_start && segment_output_write(&seg->output, reader->buf + range_start, reader->pos - range_start)) {
+                err = 1;
+                break;
+            }
+            ts_reader_fill(reader, TS_PACKET_SIZE * 3);
+            skip = ts_find_sync(reader->buf + reader->pos, reader->len - reader->pos);
+            av_log(NULL, AV_LOG_WARNING, "Lost sync, skipped %zd bytes\n", skip);
+            reader->pos += skip;
+            range_start = reader->pos;
+            continue;
+        }
+
+        pid = ((p[1] & 0x1f) << 8) | p[2];
+        end = p + TS_PACKET_SIZE;
+        payload = p + 4;
+        if (p[3] & 0x20) {
+            /* adaptation field */
+            if (p[4] > 0)
+                random_access = p[5] & 0x40;
+            payload += 1 + p[4];
+        }
+
+        if ((p[1] & 0x40) && (p[3] & 0x10) && payload < end) {
+            /* payload_unit_start_indicator */
+            if (pid == 0) {
+                ts_reader_parse_pat(reader, payload, end);
+                memcpy(reader->pat, p, TS_PACKET_SIZE);
+                reader->have_pat = 1;
+            } else if (pid == reader->pmt_pid) {
+                ts_reader_parse_pmt(reader, payload, end);
+                memcpy(reader->pmt, p, TS_PACKET_SIZE);
+                reader->have_pmt = 1;
+            } else if (pid == reader->cut_pid && reader->have_pat && reader->have_pmt &&
+                    ts_reader_parse_pes(reader, payload, end, random_access, &frame_time)) {
+                if (!seg->started) {
+                    seg->last_frame_time = frame_time;
+                    seg->started = 1;
+                    if (segmenter_open_ts_segment(seg)) {
+                        err = 1;
+                        break;
+                    }
+                    range_start = reader->pos;
+                } else {
+                    double last_frame_time = seg->last_frame_time;
+                    if (segmenter_should_cut(seg, frame_time)) {
+                        SEGMENTER_PROBE2(cut_begin, seg->writer.sequence_num, (int64_t)(frame_time * 1000));
+                        if (reader->pos > range_start && segment_output_write(&seg->output, reader->buf + range_start, reader->pos - range_start))
+                            err = 1;
+                        segmenter_finish_segment(seg, seg->last_frame_time - last_frame_time);
+                        if (err || segmenter_open_ts_segment(seg)) {
+                            err = 1;
+                            break;
+                        }
+                        range_start = reader->pos;
+                        SEGMENTER_PROBE1(cut_end, seg->writer.sequence_num);
+                    }
+                }
+            }
         }
+
+        reader->pos += TS_PACKET_SIZE;
+        if (!seg->started)
+            range_start = reader->pos;
     }
 
-    bs_filters = xcalloc(oc->nb_streams, sizeof(*bs_filters));
+#ifdef USE_THREADS
+    if (seg->clock) {
+        cut_clock_finish(seg->clock, seg->synced_round);
+        seg->clock = NULL;
+    }
+#endif /* USE_THREADS */
 
-    for (i = 0; i < oc->nb_streams; i++) {
-        const char **p = bs_filter_names.elems;
-        const char **e = bs_filter_names.elems + bs_filter_names.nelems;
-        AVBitStreamFilterContext *bs_filter = NULL;
-        for (; p < e; p++) {
-            AVBitStreamFilterContext *new_bs_filter = av_bitstream_filter_init(*p);
-            if (!new_bs_filter) {
-                av_log(NULL, AV_LOG_ERROR, "Unknown bitstream filter: %s\n", *p);
-                err = 1;
-                goto out;
-            }
-            if (bs_filter)
-                bs_filter->next = new_bs_filter;
-            bs_filter = new_bs_filter;
-            p++;
-        }
-        bs_filters[i] = bs_filter;
+    if (!seg->started) {
+        av_log(NULL, AV_LOG_ERROR, "No random access point found in '%s'\n", seg->input);
+        return 1;
     }
+    if (err || !seg->output.pb)
+        return 1;
 
+    /* the last segment lasts until the end of its last frame */
+    segmenter_finish_segment(seg, (double)(reader->max_pts + reader->frame_duration) / 90000. - seg->last_frame_time);
+    index_file_writer_finalize(&seg->writer);
 
-#if 0
-    if (av_set_parameters(oc, NULL) < 0) {
-        av_log(NULL, AV_LOG_ERROR, "Invalid output format parameters\n");
-        err = 1;
-        goto out;
-    }
-#endif
+    return 0;
+}
 
-    av_dump_format(oc, 0, output_prefix, 1);
+static void segmenter_free(Segmenter *seg)
+{
+    AVFormatContext *oc = seg->oc;
+    int i;
 
-	if (video_st) {
-        AVCodec *codec = avcodec_find_decoder(video_st->codec->codec_id);
-        if (!codec) {
-            av_log(NULL, AV_LOG_ERROR, "Could not find video decoder, key frames will not be honored\n");
-        }
+    interleaver_free(&seg->interleaver);
 
-#ifdef HAVE_AVCODEC_OPEN2
-        if (avcodec_open2(video_st->codec, codec, NULL) < 0)
+    if (seg->video_st)
+        avcodec_close(seg->video_st->codec);
+
+    if (seg->audio_st)
+        avcodec_close(seg->audio_st->codec);
+
+    if (seg->ic)
+#ifdef HAVE_AVFORMAT_CLOSE_INPUT
+        avformat_close_input(&seg->ic);
 #else
-        if (avcodec_open(video_st->codec, codec) < 0)
+        av_close_input_file(seg->ic);
 #endif
-        {
-            av_log(NULL, AV_LOG_ERROR, "Could not open video decoder, key frames will not be honored\n");
-        }
-    }
 
-    if (audio_st) {
-        AVCodec *codec = avcodec_find_decoder(audio_st->codec->codec_id);
-        if (!codec) {
-            av_log(NULL, AV_LOG_ERROR, "Could not find video decoder, key frames will not be honored\n");
-        }
+    audio_frame_reader_free(&seg->audio_reader);
+    ts_reader_free(&seg->ts_reader);
 
-#ifdef HAVE_AVCODEC_OPEN2
-        if (avcodec_open2(audio_st->codec, codec, NULL) < 0)
+    if (seg->input_pb)
+#ifdef HAVE_AVIO_CLOSE
+        avio_close(seg->input_pb);
 #else
-        if (avcodec_open(audio_st->codec, codec) < 0)
+        url_fclose(seg->input_pb);
 #endif
-        {
-            av_log(NULL, AV_LOG_ERROR, "Could not open video decoder, key frames will not be honored\n");
+
+#ifdef USE_MMAP_READER
+    mmap_reader_close(&seg->mmap_reader);
+#endif /* USE_MMAP_READER */
+
+    if (oc) {
+        if (seg->bs_filters) {
+            for (i = 0; i < oc->nb_streams; i++) {
+                AVBitStreamFilterContext *bsfc = seg->bs_filters[i];
+                while (bsfc) {
+                    AVBitStreamFilterContext *next = bsfc->next;
+                    av_bitstream_filter_close(bsfc);
+                    bsfc = next;
+                }
+            }
         }
-    }
 
-    if (index_file_writer_begin(&writer)) {
-        err = 1;
-        goto out;
-    }
+        for (i = 0; i < oc->nb_streams; i++) {
+            av_freep(&oc->streams[i]->codec);
+            av_freep(&oc->streams[i]);
+        }
 
-#ifdef HAVE_AVIO_OPEN
-    if (avio_open(&oc->pb, writer.current_ts_file, URL_WRONLY) < 0)
-#else
-    if (url_fopen(&oc->pb, writer.current_ts_file, URL_WRONLY) < 0)
-#endif
-    {
-        av_log(NULL, AV_LOG_ERROR, "Could not open '%s'\n", writer.current_ts_file);
-        err = 1;
-        goto out;
+        av_free(oc);
     }
 
-#ifdef HAVE_AVFORMAT_WRITE_HEADER
-    if (avformat_write_header(oc, NULL))
-#else
-    if (av_write_header(oc))
-#endif
-    {
-        av_log(NULL, AV_LOG_ERROR, "Could not write mpegts header to first output file\n");
-        err = 1;
-        goto out;
+    if (seg->bs_filters)
+        free(seg->bs_filters);
+
+    segment_output_close(&seg->output, NULL);
+
+    index_file_writer_free(&seg->writer);
+
+    if (seg->output_prefix)
+        free(seg->output_prefix);
+    if (seg->index_file)
+        free(seg->index_file);
+}
+
+static int segmenter_main(Segmenter *seg)
+{
+    int retval;
+    if (seg->config->audio_only) {
+        retval = segmenter_open_audio(seg);
+        if (!retval)
+            retval = segmenter_run_audio(seg);
+    } else if (seg->config->ts_passthrough) {
+        retval = segmenter_open_ts(seg);
+        if (!retval)
+            retval = segmenter_run_ts(seg);
+    } else {
+        retval = segmenter_open(seg);
+        if (!retval)
+            retval = segmenter_run(seg);
+    }
+#ifdef USE_THREADS
+    if (seg->clock) {
+        cut_clock_finish(seg->clock, seg->synced_round);
+        seg->clock = NULL;
     }
+#endif /* USE_THREADS */
+    return retval;
+}
 
-    {
-        AVPacket packet;
+#ifdef USE_THREADS
+static void *segmenter_thread(void *arg)
+{
+    Segmenter *seg = arg;
+    seg->err = segmenter_main(seg);
+    return NULL;
+}
+#endif /* USE_THREADS */
 
-        for (;;) {
-            AVStream *st;
-            ret = av_read_frame(ic, &packet);
-            if (ret == AVERROR(EAGAIN))
-                continue;
+int main(int argc, char **argv)
+{
+    SegmenterConfig config;
+    const char *output_prefix = NULL;
+    char *segment_duration_check;
+    const char *index;
+    long max_tsfiles = 0;
+    char *max_tsfiles_check;
+    CharPtrArray variant_specs = { 0, 0, 0 };
+    Segmenter *renditions = NULL;
+    size_t nrenditions = 0;
+    size_t i;
+    int err = 0;
+    int benchmark = 0;
+    char *follow_timeout_check;
+    const char *progname = argv[0];
 
-            if (ret == AVERROR_EOF)
+    config.input_format_str = NULL;
+    config.output_format_str = "mpegts";
+    config.bs_filter_names.elems = NULL;
+    config.bs_filter_names.nelems = 0;
+    config.bs_filter_names.alloc = 0;
+    config.use_mmap = 0;
+    config.follow_timeout = 0.;
+    config.manifest = 0;
+    config.with_sha256 = 0;
+    config.audio_only = 0;
+    config.ts_passthrough = 0;
+    config.queue_max_bytes = 16 << 20;
+    config.queue_max_duration = 30.;
+    config.queue_policy = INTERLEAVE_FLUSH;
+
+    {
+        int optch;
+        while ((optch = getopt(argc, argv, "ATbce:f:mp:P:q:Q:sv:w:x:")) != -1) {
+            switch (optch) {
+            case 'A':
+                /* audio-only fast path */
+                config.audio_only = 1;
                 break;
-            else if (ret < 0) {
-                char buf[1024];
-                av_strerror(ret, buf, sizeof(buf));
-                av_log(NULL, AV_LOG_WARNING, "Warning: %s (reached EOF?)\n", buf);
+            case 'T':
+                /* MPEG-TS passthrough */
+                config.ts_passthrough = 1;
                 break;
-            }
-
-            if (av_dup_packet(&packet) < 0) {
-                av_log(NULL, AV_LOG_ERROR, "Could not duplicate packet\n");
-                av_free_packet(&packet);
+            case 'b':
+                /* benchmark input readers */
+                benchmark = 1;
                 break;
-            }
-
-            if (packet.stream_index == video_index) {
-                video_frame_time = (double)packet.pts * video_st->codec->time_base.num / video_st->codec->time_base.den;
-                st = video_st;
-            } else {
-                audio_frame_time = (double)packet.pts * audio_st->codec->time_base.num / audio_st->codec->time_base.den;
-                st = audio_st;
-            }
-            packet.pts = packet.pts * st->codec->time_base.num * st->time_base.den / st->codec->time_base.den * st->time_base.num;
-            packet.dts = packet.dts * st->codec->time_base.num * st->time_base.den / st->codec->time_base.den * st->time_base.num;
-
-            av_log(NULL, AV_LOG_INFO, "video frame time=%f, audio frame time=%f\n", video_frame_time, audio_frame_time);
-            if (video_st) {
-                if (audio_st) {
-                    frame_time = video_frame_time < audio_frame_time ? video_frame_time: audio_frame_time;
+            case 'c':
+                /* segment manifest */
+                config.manifest = 1;
+                break;
+            case 'e':
+                /* format */
+                config.input_format_str = optarg;
+                break;
+            case 'f':
+                /* format */
+                config.output_format_str = optarg;
+                break;
+            case 'm':
+                /* memory-mapped input */
+                config.use_mmap = 1;
+                break;
+            case 'p':
+                /* prefix */
+                output_prefix = optarg;
+                break;
+            case 'P':
+                /* interleave queue policy */
+                if (!strcmp(optarg, "flush")) {
+                    config.queue_policy = INTERLEAVE_FLUSH;
+                } else if (!strcmp(optarg, "drop")) {
+                    config.queue_policy = INTERLEAVE_DROP;
+                } else if (!strcmp(optarg, "gap")) {
+                    config.queue_policy = INTERLEAVE_GAP;
                 } else {
-                    frame_time = video_frame_time;
+                    av_log(NULL, AV_LOG_ERROR, "Interleave queue policy (%s) invalid, must be one of flush, drop or gap\n", optarg);
+                    return 1;
                 }
-            } else {
-                assert(audio_st != NULL);
-                frame_time = audio_frame_time;
-            }
-
-            {
-                AVBitStreamFilterContext *bsfc = bs_filters[st->index];
-                for (; bsfc; bsfc = bsfc->next) {
-                    AVPacket filtered = packet;
-                    ret = av_bitstream_filter_filter(bsfc, st->codec, NULL,
-                            &filtered.data, &filtered.size,
-                            packet.data, packet.size,
-                            packet.flags & AV_PKT_FLAG_KEY);
-                    if (ret < 0) {
-                        av_log(NULL, AV_LOG_ERROR, "Failed to apply bitstream filters\n");
-                        err = 1;
-                        goto out;
-                    }
-                    if (ret > 0) {
-                        av_free_packet(&packet);
-                        filtered.destruct = av_destruct_packet;
-                        packet = filtered;
+                break;
+            case 'q':
+                /* interleave queue size cap */
+                {
+                    char *check;
+                    long long max_bytes = strtoll(optarg, &check, 10);
+                    if (check == optarg || max_bytes < 0) {
+                        av_log(NULL, AV_LOG_ERROR, "Interleave queue size (%s) invalid\n", optarg);
+                        return 1;
                     }
+                    config.queue_max_bytes = max_bytes;
                 }
-            }
-
-            if ((packet.flags & PKT_FLAG_KEY) && frame_time - last_frame_time >= segment_duration) {
-                av_log(NULL, AV_LOG_DEBUG, "Flushing\n");
-#ifdef HAVE_AVIO_FLUSH
-                avio_flush(oc->pb);
-#else
-                put_flush_packet(oc->pb);
-#endif
-#ifdef HAVE_AVIO_CLOSE
-                avio_close(oc->pb);
-#else
-                url_fclose(oc->pb);
-#endif
-
-                index_file_writer_write_index(&writer, segment_duration);
-
-#ifdef HAVE_AVIO_OPEN
-                if (avio_open(&oc->pb, writer.current_ts_file, URL_WRONLY) < 0)
-#else
-                if (url_fopen(&oc->pb, writer.current_ts_file, URL_WRONLY) < 0)
-#endif
+                break;
+            case 'Q':
+                /* interleave queue duration cap */
                 {
-                    av_log(NULL, AV_LOG_ERROR, "Could not open '%s'\n", writer.current_ts_file);
-                    av_free_packet(&packet);
-                    break;
+                    char *check;
+                    config.queue_max_duration = strtod(optarg, &check);
+                    if (check == optarg || config.queue_max_duration < 0.) {
+                        av_log(NULL, AV_LOG_ERROR, "Interleave queue duration (%s) invalid\n", optarg);
+                        return 1;
+                    }
                 }
-
-                last_frame_time = frame_time;
-            }
-
-            ret = av_interleaved_write_frame(oc, &packet);
-            if (ret < 0) {
-                av_log(NULL, AV_LOG_ERROR, "Warning: Could not write frame of stream\n");
-            }
-            else if (ret > 0) {
-                av_log(NULL, AV_LOG_ERROR, "End of stream requested\n");
-                av_free_packet(&packet);
+                break;
+            case 's':
+                /* SHA-256 in the segment manifest */
+                config.manifest = 1;
+                config.with_sha256 = 1;
+                break;
+            case 'v':
+                /* additional rendition */
+                char_ptr_array_append(&variant_specs, (char *)optarg);
+                break;
+            case 'w':
+                /* wait for a growing input file */
+                config.follow_timeout = strtod(optarg, &follow_timeout_check);
+                if (follow_timeout_check == optarg || config.follow_timeout < 0.) {
+                    av_log(NULL, AV_LOG_ERROR, "Growth wait time (%s) invalid\n", optarg);
+                    return 1;
+                }
+                config.use_mmap = 1;
+                break;
+            case 'x':
+                /* filter */
+                char_ptr_array_append(&config.bs_filter_names, (char *)optarg);
                 break;
             }
-
-            av_free_packet(&packet);
         }
     }
+    argc -= optind;
+    argv += optind;
 
-    av_write_trailer(oc);
-
-    if (ic->duration != AV_NOPTS_VALUE)
-        index_file_writer_write_index(&writer, ((double)ic->duration / AV_TIME_BASE) - last_frame_time);
-    else
-        index_file_writer_write_index(&writer, segment_duration);
+    if (benchmark && argc >= 1) {
+        av_register_all();
+        return benchmark_input_readers(argv[0]);
+    }
 
-    index_file_writer_finalize(&writer);
+    if (argc < 4 || argc > 5) {
+        av_log(NULL, AV_LOG_ERROR, "Usage: %s [-A] [-T] [-b] [-c] [-s] [-m] [-w growth_wait_seconds] [-e input_format] [-f output_format] [-p output_prefix] [-q queue_bytes] [-Q queue_seconds] [-P flush|drop|gap] [-v input[,output_prefix]] [-x filter] <input MPEG-TS / MP3 file> <segment duration in seconds> <output m3u8 index file> <http prefix> [<segment window size>]\n", progname);
+        return 1;
+    }
 
-out:
-    if (output_prefix)
-        free(output_prefix);
+#ifndef USE_THREADS
+    if (variant_specs.nelems > 0) {
+        av_log(NULL, AV_LOG_ERROR, "Multiple renditions are not supported without threads\n");
+        return 1;
+    }
+#endif /* USE_THREADS */
 
-    if (video_st)
-        avcodec_close(video_st->codec);
+    av_register_all();
+    crc32c_init();
 
-    if (audio_st)
-        avcodec_close(audio_st->codec);
+    config.segment_duration = strtod(argv[1], &segment_duration_check);
+    if (segment_duration_check == argv[1] || config.segment_duration == HUGE_VAL || config.segment_duration == -HUGE_VAL) {
+        av_log(NULL, AV_LOG_ERROR, "Segment duration time (%s) invalid\n", argv[1]);
+        return 1;
+    }
+    index = argv[2];
+    config.http_prefix = argv[3];
+    if (argc == 5) {
+        max_tsfiles = strtol(argv[4], &max_tsfiles_check, 10);
+        if (max_tsfiles_check == argv[4] || max_tsfiles < 0 || max_tsfiles >= INT_MAX) {
+            av_log(NULL, AV_LOG_ERROR, "Maximum number of ts files (%s) invalid\n", argv[4]);
+            return 1;
+        }
+    }
 
-    if (ic)
-#ifdef HAVE_AVFORMAT_CLOSE_INPUT
-        avformat_close_input(&ic);
-#else
-        av_close_input_file(ic);
-#endif
+    renditions = xcalloc(variant_specs.nelems + 1, sizeof(*renditions));
 
-    if (oc) {
-        for (i = 0; i < oc->nb_streams; i++) {
-            AVBitStreamFilterContext *bsfc = bs_filters[i];
-            while (bsfc) {
-                AVBitStreamFilterContext *next = bsfc->next;
-                av_bitstream_filter_close(bsfc);
-                bsfc = next;
+    /* with more than one rendition, the index file given is the master playlist */
+    nrenditions++;
+    if (segmenter_init(&renditions[0], &config, argv[0], output_prefix, variant_specs.nelems > 0 ? NULL: index)) {
+        err = 1;
+        goto out;
+    }
+    for (i = 0; i < variant_specs.nelems; i++) {
+        /* input[,output_prefix] */
+        char *spec = (char *)variant_specs.elems[i];
+        char *sep = strrchr(spec, ',');
+        size_t j;
+        if (sep)
+            *sep++ = '\0';
+        nrenditions++;
+        if (segmenter_init(&renditions[i + 1], &config, spec, sep, NULL)) {
+            err = 1;
+            goto out;
+        }
+        for (j = 0; j <= i; j++) {
+            if (!strcmp(renditions[j].output_prefix, renditions[i + 1].output_prefix)) {
+                av_log(NULL, AV_LOG_ERROR, "Renditions must have distinct output prefixes (%s)\n", renditions[j].output_prefix);
+                err = 1;
+                goto out;
             }
         }
-
-        for (i = 0; i < oc->nb_streams; i++) {
-            av_freep(&oc->streams[i]->codec);
-            av_freep(&oc->streams[i]);
+    }
+    for (i = 0; nrenditions > 1 && i < nrenditions; i++) {
+        if (!strcmp(renditions[i].index_file, index)) {
+            av_log(NULL, AV_LOG_ERROR, "Index file of rendition '%s' would overwrite the master playlist (%s), give it another output prefix\n", renditions[i].input, index);
+            err = 1;
+            goto out;
         }
+    }
 
-        if (oc->pb) {
-#ifdef HAVE_AVIO_CLOSE
-            avio_close(oc->pb);
-#else
-            url_fclose(oc->pb);
-#endif
-        }
-        av_free(oc);
+    if (nrenditions == 1) {
+        err = segmenter_main(&renditions[0]);
     }
+#ifdef USE_THREADS
+    else {
+        CutClock clock;
+        MasterPlaylistWriter master;
+
+#ifdef HAVE_AV_LOCKMGR_REGISTER
+        av_lockmgr_register(lock_manager);
+#endif /* HAVE_AV_LOCKMGR_REGISTER */
+        cut_clock_init(&clock, nrenditions);
+        master_playlist_writer_init(&master, index, config.http_prefix, renditions, nrenditions);
+
+        for (i = 0; i < nrenditions; i++) {
+            renditions[i].clock = &clock;
+            renditions[i].master = &master;
+            if (pthread_create(&renditions[i].thread, NULL, segmenter_thread, &renditions[i])) {
+                av_log(NULL, AV_LOG_ERROR, "Could not start thread for '%s'\n", renditions[i].input);
+                renditions[i].err = 1;
+                renditions[i].clock = NULL;
+                cut_clock_finish(&clock, renditions[i].synced_round);
+                continue;
+            }
+            renditions[i].thread_started = 1;
+        }
+        for (i = 0; i < nrenditions; i++) {
+            if (renditions[i].thread_started)
+                pthread_join(renditions[i].thread, NULL);
+            err |= renditions[i].err;
+        }
+        err |= master_playlist_writer_write(&master);
 
-    if (bs_filters)
-        free(bs_filters);
+        master_playlist_writer_free(&master);
+        cut_clock_destroy(&clock);
+    }
+#endif /* USE_THREADS */
 
-    index_file_writer_free(&writer);
+out:
+    for (i = 0; i < nrenditions; i++)
+        segmenter_free(&renditions[i]);
+    if (renditions)
+        free(renditions);
 
-    char_ptr_array_free(&bs_filter_names);
+    char_ptr_array_free(&variant_specs);
+    char_ptr_array_free(&config.bs_filter_names);
 
-    return 0;
+    return err;
 }
 
 // vim:sw=4:ts=4:ai:expandtab